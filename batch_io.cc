@@ -0,0 +1,357 @@
+#include "batch_io.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+#ifdef _WIN32
+using ssize_t = SSIZE_T;
+// Winsock has no per-call flag, sends on a blocking socket wait there
+#define MSG_DONTWAIT 0
+#endif
+
+#ifdef __linux__
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#endif
+
+namespace
+{
+	constexpr size_t MAX_SEND_BATCH = 1024; // UIO_MAXIOV
+
+	bool would_block()
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+
+	// Set once segmentation failed on the socket, so batches created later
+	// don't try it again
+	std::atomic<bool> segmentation_failed { false };
+}
+
+void datagram_run::clear()
+{
+	data.clear();
+	sizes.clear();
+}
+
+size_t datagram_run::datagram_count() const
+{
+	return sizes.size();
+}
+
+const std::uint8_t* datagram_batch::entry::data() const
+{
+	return run->data.data() + offset;
+}
+
+datagram_batch::datagram_batch(int socket)
+: m_socket(socket)
+{
+#ifdef __linux__
+	// Setting zero segment size is a no-op, so use it to check for kernel support
+	int segment_size = 0;
+	m_segmentation = !segmentation_failed && setsockopt(m_socket, SOL_UDP, UDP_SEGMENT,
+		&segment_size, sizeof(segment_size)) == 0;
+#endif
+}
+
+bool datagram_batch::can_append(const entry& entry, size_t datagram_size) const
+{
+	return m_segmentation
+		&& entry.segment_count < MAX_SEGMENTS
+		// Every but last segment has to be exactly segment_size long
+		&& entry.length == entry.segment_size * entry.segment_count
+		&& datagram_size <= entry.segment_size;
+}
+
+void datagram_batch::add(const sockaddr_storage& address, std::shared_ptr<const datagram_run> datagrams,
+	size_t datagram_count)
+{
+	const size_t first_entry = m_entries.size();
+
+	size_t offset = 0;
+	for (size_t i = 0; i < datagram_count; ++i)
+	{
+		const size_t size = datagrams->sizes[i];
+		m_datagram_count++;
+
+		// Datagrams of a single run are adjacent, so GSO segments are simply
+		// a longer slice of the run
+		if (m_entries.size() > first_entry && can_append(m_entries.back(), size))
+		{
+			entry& last = m_entries.back();
+			last.length += size;
+			last.segment_count++;
+		}
+		else
+			m_entries.push_back(entry { address, datagrams, offset, size, size, 1 });
+
+		offset += size;
+	}
+}
+
+size_t datagram_batch::size() const
+{
+	return m_datagram_count;
+}
+
+bool datagram_batch::segmentation_enabled() const
+{
+	return m_segmentation;
+}
+
+bool datagram_batch::send_segments_separately(entry& entry, size_t& sent)
+{
+	while (entry.segment_count > 0)
+	{
+		const size_t len = std::min(entry.segment_size, entry.length);
+		ssize_t snd_len = sendto(m_socket, (const char*)entry.data(), len, MSG_DONTWAIT,
+			(const sockaddr*)&entry.address, sizeof(entry.address));
+
+		if (snd_len == static_cast<ssize_t>(len))
+			sent++;
+		else if (would_block())
+			return false;
+		else
+			fprintf(stderr, "Error sending events (sendto)\n");
+
+		entry.offset += len;
+		entry.length -= len;
+		entry.segment_count--;
+	}
+	return true;
+}
+
+void datagram_batch::split_segments(size_t first)
+{
+	std::vector<entry> entries(m_entries.begin(), m_entries.begin() + first);
+	for (size_t i = first; i < m_entries.size(); ++i)
+	{
+		const entry& gso = m_entries[i];
+		for (size_t offset = 0; offset < gso.length; offset += gso.segment_size)
+		{
+			const size_t len = std::min(gso.segment_size, gso.length - offset);
+			entries.push_back(entry { gso.address, gso.run, gso.offset + offset, len, len, 1 });
+		}
+	}
+	m_entries = std::move(entries);
+}
+
+void datagram_batch::disable_segmentation(int error)
+{
+	fprintf(stderr, "UDP segmentation failed (%s), disabling it\n", strerror(error));
+	m_segmentation = false;
+	segmentation_failed = true;
+}
+
+#ifdef __linux__
+const std::vector<mmsghdr>& datagram_batch::build_messages()
+{
+	const size_t count = m_entries.size();
+	m_messages.resize(count);
+	m_iovecs.resize(count);
+	m_controls.resize(count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		entry& entry = m_entries[i];
+		m_iovecs[i].iov_base = const_cast<std::uint8_t*>(entry.data());
+		m_iovecs[i].iov_len = entry.length;
+
+		mmsghdr& message = m_messages[i];
+		memset(&message, 0x00, sizeof(message));
+		message.msg_hdr.msg_name = &entry.address;
+		message.msg_hdr.msg_namelen = sizeof(entry.address);
+		message.msg_hdr.msg_iov = &m_iovecs[i];
+		message.msg_hdr.msg_iovlen = 1;
+
+		if (entry.segment_count > 1)
+		{
+			message.msg_hdr.msg_control = m_controls[i].buffer;
+			message.msg_hdr.msg_controllen = sizeof(m_controls[i].buffer);
+
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&message.msg_hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+			const std::uint16_t segment_size = entry.segment_size;
+			memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+		}
+	}
+
+	return m_messages;
+}
+
+size_t datagram_batch::datagram_count(size_t message) const
+{
+	return m_entries[message].segment_count;
+}
+
+void datagram_batch::handle_send_error(size_t message, int error, datagram_batch& retry)
+{
+	const entry& failed = m_entries[message];
+	if (error == EAGAIN || error == EWOULDBLOCK)
+	{
+		retry.requeue(failed);
+		return;
+	}
+
+	if (failed.segment_count > 1)
+	{
+		// Send these datagrams the usual way
+		disable_segmentation(error);
+		entry rest = failed;
+		size_t sent = 0;
+		if (!send_segments_separately(rest, sent))
+			retry.requeue(rest);
+	}
+	else
+		fprintf(stderr, "Error sending events: %s\n", strerror(error));
+}
+#endif
+
+size_t datagram_batch::flush()
+{
+	size_t sent = 0;
+#ifdef __linux__
+	auto& messages = build_messages();
+
+	size_t next = 0;
+	while (next < messages.size())
+	{
+		const size_t count = std::min(messages.size() - next, MAX_SEND_BATCH);
+
+		const int ret = sendmmsg(m_socket, m_messages.data() + next, count, MSG_DONTWAIT);
+		if (ret >= 0)
+		{
+			for (int i = 0; i < ret; ++i)
+				sent += datagram_count(next + i);
+			next += ret;
+		}
+		else if (would_block())
+		{
+			// Socket buffer is full, the rest waits for the next flush
+			break;
+		}
+		else if (m_entries[next].segment_count > 1)
+		{
+			// Send the rest of the datagrams the usual way, in this flush
+			disable_segmentation(errno);
+			split_segments(next);
+			build_messages();
+		}
+		else
+		{
+			// Only the first message failed (e.g. its destination is
+			// unreachable), skip it and try the rest
+			fprintf(stderr, "Error sending events: %s\n", strerror(errno));
+			next++;
+		}
+	}
+#else
+	size_t next = 0;
+	while (next < m_entries.size() && send_segments_separately(m_entries[next], sent))
+		next++;
+#endif
+	drop_sent(next);
+	return sent;
+}
+
+void datagram_batch::requeue(const entry& entry)
+{
+	m_entries.push_back(entry);
+	m_datagram_count += entry.segment_count;
+}
+
+void datagram_batch::drop_sent(size_t count)
+{
+	m_entries.erase(m_entries.begin(), m_entries.begin() + count);
+	// Don't pile up datagrams while the socket stays full, clients get lost
+	// events again after retransmission timeout anyway
+	if (m_entries.size() > MAX_SEND_BATCH)
+		m_entries.erase(m_entries.begin() + MAX_SEND_BATCH, m_entries.end());
+
+	m_datagram_count = 0;
+	for (const entry& entry : m_entries)
+		m_datagram_count += entry.segment_count;
+}
+
+void datagram_batch::clear()
+{
+	m_entries.clear();
+	m_datagram_count = 0;
+}
+
+datagram_receiver::datagram_receiver(int socket)
+: m_socket(socket)
+, m_slots(MAX_DATAGRAMS)
+{
+}
+
+int datagram_receiver::receive()
+{
+#ifdef __linux__
+	mmsghdr messages[MAX_DATAGRAMS];
+	iovec iovecs[MAX_DATAGRAMS];
+	for (size_t i = 0; i < MAX_DATAGRAMS; ++i)
+	{
+		iovecs[i].iov_base = m_slots[i].buffer;
+		iovecs[i].iov_len = sizeof(m_slots[i].buffer);
+
+		memset(&messages[i], 0x00, sizeof(messages[i]));
+		messages[i].msg_hdr.msg_name = &m_slots[i].address;
+		messages[i].msg_hdr.msg_namelen = sizeof(m_slots[i].address);
+		messages[i].msg_hdr.msg_iov = &iovecs[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	// Wait only for the first datagram, then take whatever else is queued
+	int count = recvmmsg(m_socket, messages, MAX_DATAGRAMS, MSG_WAITFORONE, nullptr);
+	for (int i = 0; i < count; ++i)
+	{
+		m_slots[i].length = messages[i].msg_len;
+		m_slots[i].truncated = (messages[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+	}
+	return count;
+#else
+	slot& slot = m_slots[0];
+	socklen_t address_len = (socklen_t) sizeof(slot.address);
+	ssize_t len = recvfrom(m_socket, slot.buffer, sizeof(slot.buffer), 0,
+		(sockaddr*)&slot.address, &address_len);
+	if (len < 0)
+		return -1;
+
+	slot.length = len;
+	slot.truncated = false;
+	return 1;
+#endif
+}
+
+const char* datagram_receiver::data(size_t i) const
+{
+	return m_slots[i].buffer;
+}
+
+size_t datagram_receiver::length(size_t i) const
+{
+	return m_slots[i].length;
+}
+
+bool datagram_receiver::truncated(size_t i) const
+{
+	return m_slots[i].truncated;
+}
+
+const sockaddr_storage& datagram_receiver::address(size_t i) const
+{
+	return m_slots[i].address;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <ws2ipdef.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+// Consecutive datagrams stored back to back in a single buffer
+struct datagram_run
+{
+	std::vector<std::uint8_t> data;
+	std::vector<std::uint16_t> sizes; // size of every datagram, in order
+
+	void clear();
+	size_t datagram_count() const;
+};
+
+// Queues outgoing datagrams and sends them with as few syscalls as possible:
+// sendmmsg on Linux, one sendto per datagram elsewhere. If the kernel supports
+// UDP GSO (UDP_SEGMENT), consecutive datagrams to the same address of equal
+// size (only the last one may be shorter) are sent as a single buffer which
+// the kernel cuts into separate datagrams. Queued datagrams aren't copied,
+// batch only keeps a reference to them, so one run can be shared by many
+// destinations.
+class datagram_batch
+{
+public:
+	// Kernel limit for number of segments in one GSO send
+	constexpr static size_t MAX_SEGMENTS = 64;
+
+	explicit datagram_batch(int socket);
+
+	// Queues first datagram_count datagrams of the run
+	void add(const sockaddr_storage& address, std::shared_ptr<const datagram_run> datagrams,
+		size_t datagram_count);
+	// Number of queued datagrams
+	size_t size() const;
+	// Sends queued datagrams without blocking, returns how many of them were
+	// sent. Ones the socket had no room for stay queued (up to a single
+	// sendmmsg worth) and go first on the next flush, the rest is dropped.
+	size_t flush();
+	// Drops all queued datagrams without sending them
+	void clear();
+
+#ifdef __linux__
+	// Prepares message headers for all queued datagrams (to be submitted
+	// elsewhere, e.g. io_uring), valid until batch is modified
+	const std::vector<mmsghdr>& build_messages();
+	// How many datagrams given message contains
+	size_t datagram_count(size_t message) const;
+	// Handles failure to send message with given errno, datagrams the socket
+	// had no room for are queued to retry
+	void handle_send_error(size_t message, int error, datagram_batch& retry);
+#endif
+
+	bool segmentation_enabled() const;
+
+private:
+	// Single message to send, either single datagram or GSO segments
+	struct entry
+	{
+		sockaddr_storage address;
+		std::shared_ptr<const datagram_run> run;
+		size_t offset; // position of the first datagram in the run
+		size_t length;
+		size_t segment_size; // size of every but last datagram
+		size_t segment_count;
+
+		const std::uint8_t* data() const;
+	};
+
+	bool can_append(const entry& entry, size_t datagram_size) const;
+	// Drops entries which were already sent (or failed) and keeps the rest
+	void drop_sent(size_t count);
+	void requeue(const entry& entry);
+	// Sends entry's datagrams one by one without blocking and removes them
+	// from the entry, returns false if the socket had no room for the rest
+	bool send_segments_separately(entry& entry, size_t& sent);
+	// Replaces GSO entries starting with first by single datagram entries
+	void split_segments(size_t first);
+	// Device can't segment (e.g. no checksum offload), so don't try again
+	void disable_segmentation(int error);
+
+	int m_socket;
+	bool m_segmentation = false;
+	size_t m_datagram_count = 0;
+	std::vector<entry> m_entries;
+
+#ifdef __linux__
+	union control_t
+	{
+		char buffer[CMSG_SPACE(sizeof(std::uint16_t))];
+		cmsghdr align;
+	};
+
+	std::vector<mmsghdr> m_messages;
+	std::vector<iovec> m_iovecs;
+	std::vector<control_t> m_controls;
+#endif
+};
+
+// Receives up to MAX_DATAGRAMS incoming datagrams at once (recvmmsg on
+// Linux, single recvfrom elsewhere)
+class datagram_receiver
+{
+public:
+	constexpr static size_t MAX_DATAGRAMS = 32;
+	constexpr static size_t MAX_DATAGRAM_SIZE = 2048;
+
+	explicit datagram_receiver(int socket);
+
+	// Blocks until at least one datagram arrives and then drains what's
+	// already queued, returns number of received datagrams or -1 on error
+	int receive();
+
+	const char* data(size_t i) const;
+	size_t length(size_t i) const;
+	// Datagram didn't fit in the buffer and was cut
+	bool truncated(size_t i) const;
+	const sockaddr_storage& address(size_t i) const;
+
+private:
+	struct slot
+	{
+		char buffer[MAX_DATAGRAM_SIZE];
+		size_t length;
+		bool truncated;
+		sockaddr_storage address;
+	};
+
+	int m_socket;
+	std::vector<slot> m_slots;
+};
@@ -40,6 +40,7 @@ using ssize_t = SSIZE_T;
 #include "util.h"
 #include "rand.h"
 #include "map.h"
+#include "reorder_buffer.h"
 
 using namespace std::chrono;
 
@@ -71,6 +72,7 @@ static server_connection& game_server = servers[0];
 static server_connection& gui_server = servers[1];
 
 // TODO: Handle this
+static bool game_started = false;
 static std::uint32_t game_id;
 static std::uint32_t next_expected_event;
 
@@ -82,7 +84,11 @@ static std::uint64_t session_id;
 static std::string player_name;
 static std::int8_t turn_direction;
 
-static std::vector<std::shared_ptr<event>> queued_events;
+static std::vector<event> queued_events;
+// Player names for every queued NEW_GAME, in order
+static std::vector<std::vector<std::string>> queued_player_names;
+// Events of the current game received past next_expected_event
+static reorder_buffer out_of_order_events;
 static std::recursive_mutex events_lock;
 
 namespace {
@@ -128,6 +134,134 @@ namespace {
 	}
 }
 
+void send_to_game_server(const std::uint8_t* buffer, size_t buffer_len)
+{
+	ssize_t snd_len = sendto(game_server.socket, (const char*)buffer, buffer_len, 0,
+		(sockaddr*)&game_server.addr, game_server.addrlen);
+	if ((size_t)snd_len != buffer_len)
+	{
+#ifdef _WIN32
+		fprintf(stderr, "socket: WSAGetLastError: %d\n", WSAGetLastError());
+#endif
+		fprintf(stderr, "errno: %d\n", errno);
+		util::fatal("Error sending heartbeat message to server");
+	}
+}
+
+// Server ignores heartbeats which come within 2 ms of the previous one, so
+// heartbeats are never sent closer than this (with margin for jitter)
+constexpr std::chrono::milliseconds MIN_HEARTBEAT_DELAY { 5 };
+
+static std::mutex heartbeat_lock;
+static steady_clock::time_point last_heartbeat_time;
+
+// Measures how long key state changes from GUI wait before a heartbeat with
+// them is sent (not until the server reacts to them), reported after every
+// game (guarded by heartbeat_lock)
+static struct {
+	bool change_pending = false;
+	steady_clock::time_point change_time; // of the earliest change not sent yet
+
+	std::uint64_t changes = 0;
+	std::chrono::microseconds total_delay { 0 };
+	std::chrono::microseconds max_delay { 0 };
+	std::uint32_t game_id = 0;
+
+	void changed(steady_clock::time_point time)
+	{
+		if (!change_pending)
+			change_time = time;
+		change_pending = true;
+	}
+
+	void sent(steady_clock::time_point time)
+	{
+		if (!change_pending)
+			return;
+
+		const auto delay = duration_cast<microseconds>(time - change_time);
+		change_pending = false;
+		changes++;
+		total_delay += delay;
+		max_delay = std::max(max_delay, delay);
+	}
+
+	void report_and_reset()
+	{
+		if (changes > 0)
+		{
+			fprintf(stderr, "Key to heartbeat send: %llu turn direction changes, "
+				"mean %lld us, max %lld us\n",
+				(unsigned long long)changes,
+				(long long)(total_delay.count() / changes),
+				(long long)max_delay.count());
+		}
+		changes = 0;
+		total_delay = max_delay = std::chrono::microseconds::zero();
+	}
+} key_send_delay;
+
+// Sends heartbeat followed by selective acknowledgement if we hold events past
+// next_expected_event, heartbeat_lock has to be held
+void send_heartbeat()
+{
+	client_message msg { session_id, turn_direction, next_expected_event };
+	memcpy(msg.player_name, player_name.data(), player_name.size());
+
+	// Report events we hold past next_expected_event, if there are any
+	selective_ack ack;
+	{
+		std::lock_guard<std::recursive_mutex> _lock(events_lock);
+		msg.next_expected_event = next_expected_event;
+
+		ack.session_id = session_id;
+		ack.next_expected_event = next_expected_event;
+		ack.game_id = game_id;
+		out_of_order_events.acknowledge(ack);
+	}
+
+	std::uint8_t buffer[client_message::MAX_LEN];
+	send_to_game_server(buffer, msg.serialize(buffer, sizeof(buffer)));
+
+	if (ack.bitmap_len > 0)
+	{
+		std::uint8_t ack_buffer[selective_ack_layout::size + selective_ack::MAX_BITMAP_LEN];
+		send_to_game_server(ack_buffer, ack.serialize(ack_buffer, sizeof(ack_buffer)));
+	}
+	last_heartbeat_time = steady_clock::now();
+	key_send_delay.sent(last_heartbeat_time);
+}
+
+// Sends heartbeat as soon as the server would accept it, lock has to hold
+// heartbeat_lock. It's released while waiting, so others can send meanwhile.
+void send_heartbeat_when_allowed(std::unique_lock<std::mutex>& lock)
+{
+	while (true)
+	{
+		const auto since_last = steady_clock::now() - last_heartbeat_time;
+		if (since_last >= MIN_HEARTBEAT_DELAY)
+			break;
+
+		lock.unlock();
+		std::this_thread::sleep_for(MIN_HEARTBEAT_DELAY - since_last);
+		lock.lock();
+	}
+
+	send_heartbeat();
+}
+
+// Sends heartbeat right away, outside of the regular ones, unless one was sent
+// too recently (or is being sent), returns whether it was sent
+bool send_extra_heartbeat()
+{
+	std::unique_lock<std::mutex> lock(heartbeat_lock, std::try_to_lock);
+	if (!lock.owns_lock() || steady_clock::now() - last_heartbeat_time < MIN_HEARTBEAT_DELAY)
+		return false;
+
+	send_heartbeat();
+	return true;
+}
+
 void send_game_job()
 {
 	constexpr std::chrono::milliseconds HEARTBEAT_INTERVAL { 20 };
@@ -135,22 +269,16 @@ void send_game_job()
 	{
 		auto start_time = current_time_microseconds();
 		{
-			client_message msg { session_id, turn_direction, next_expected_event };
-			memcpy(msg.player_name, player_name.data(), player_name.size());
-
-			const auto buffer = msg.as_stream();
-			// Send heartbeat to 
-			ssize_t snd_len = sendto(game_server.socket, (const char*)buffer.data(), buffer.size(), 0,
-				(sockaddr*)&game_server.addr, game_server.addrlen);
-			if ((size_t)snd_len != buffer.size())
+			std::unique_lock<std::mutex> lock(heartbeat_lock);
+			// Extra heartbeat could have been sent just now
+			send_heartbeat_when_allowed(lock);
+
+			std::lock_guard<std::recursive_mutex> _events_lock(events_lock);
+			if (game_started && game_id != key_send_delay.game_id)
 			{
-#ifdef _WIN32
-				fprintf(stderr, "socket: WSAGetLastError: %d\n", WSAGetLastError());
-#endif
-				fprintf(stderr, "errno: %d\n", errno);
-				util::fatal("Error sending heartbeat message to server");
+				key_send_delay.report_and_reset();
+				key_send_delay.game_id = game_id;
 			}
-
 		}
 		auto elapsed = current_time_microseconds() - start_time;
 		if (elapsed < HEARTBEAT_INTERVAL)
@@ -166,6 +294,10 @@ constexpr int RECV_BUFFER_SIZE = 10000;
 void receive_game_job()
 {
 	char buffer[RECV_BUFFER_SIZE];
+	// Gap (game and next_expected_event) the server was last told about
+	std::uint32_t reported_gap_game_id = 0;
+	std::uint32_t reported_gap_event = 0;
+	bool gap_reported = false;
 	while (true)
 	{
 		auto read_len = recv(game_server.socket, buffer, RECV_BUFFER_SIZE, 0);
@@ -174,57 +306,100 @@ void receive_game_job()
 			std::exit(1);
 		}
 
-		auto pair = server_message::from(buffer, read_len);
-		if (pair.second == false) {
+		server_message_view msg;
+		if (!server_message_view::parse(buffer, read_len, msg)) {
 			fprintf(stderr, "Game recv: Couldn't parse server message");
 			continue;
 		}
 
+		bool new_gap = false;
 		// Verify data from the server
-		const server_message& msg = pair.first;
-		for (auto event : msg.events)
+		for (const auto& event : msg)
 		{
-			switch (event->event_type)
+			// Events of other games (e.g. late ones of the previous game) don't
+			// count, only NEW_GAME can start a new one
+			if (event.event_type() != NEW_GAME && (!game_started || msg.game_id != game_id))
+				continue;
+
+			switch (event.event_type())
 			{
 			case NEW_GAME:
 			{
-				game_id = msg.game_id;
-				next_expected_event = 0;
-
-				new_game* new_game = static_cast<struct new_game*>(event.get());
-				if (new_game->event_no != 0) {
+				const auto new_game = event.as_new_game();
+				if (event.event_no() != 0) {
 					fprintf(stderr, "Received invalid NEW_GAME with event_no != 0\n");
 					std::exit(1);
 				}
+				// Server sent NEW_GAME of the current game again
+				if (game_started && msg.game_id == game_id)
+					break;
+
+				std::lock_guard<std::recursive_mutex> _lock(events_lock);
+				game_started = true;
+				game_id = msg.game_id;
+				next_expected_event = 0;
+				out_of_order_events.reset(game_id);
 
-				active_player_names = new_game->player_names;
-				maxx = new_game->maxx;
-				maxy = new_game->maxy;
+				active_player_names = new_game.player_names().to_vector();
+				maxx = new_game.maxx();
+				maxy = new_game.maxy();
 				break;
 			}
 			case PIXEL:
 			{
-				pixel* pixel = static_cast<struct pixel*>(event.get());
-				if (pixel->player_number >= active_player_names.size() || pixel->x > maxx || pixel->y > maxy)
+				const auto pixel = event.as_pixel();
+				if (pixel.player_number() >= active_player_names.size() || pixel.x() > maxx || pixel.y() > maxy)
 					util::fatal("PIXEL event from server contains invalid data, quitting");
 				break;
 			}
 			case PLAYER_ELIMINATED:
 			{
-				player_eliminated* elim = static_cast<player_eliminated*>(event.get());
-				if (elim->player_number >= active_player_names.size())
+				const auto elim = event.as_player_eliminated();
+				if (elim.player_number() >= active_player_names.size())
 					util::fatal("PLAYER_ELIMINATED contains invalid player number");
 				break;
 			}
 			default: break;
 			}
 
-			if (next_expected_event == event->event_no)
+			std::lock_guard<std::recursive_mutex> _lock(events_lock);
+			if (next_expected_event == event.event_no())
 			{
-				std::lock_guard<std::recursive_mutex> _lock(events_lock);
-
 				next_expected_event++;
-				queued_events.push_back(event);
+				queued_events.push_back(event.to_event());
+				if (event.event_type() == NEW_GAME)
+					queued_player_names.push_back(active_player_names);
+
+				// Events which were waiting for this one can be queued as well
+				struct event held;
+				while (out_of_order_events.take(next_expected_event, held))
+				{
+					next_expected_event++;
+					queued_events.push_back(held);
+				}
+			}
+			else if (out_of_order_events.insert(msg.game_id, next_expected_event, event.to_event()))
+			{
+				new_gap = !gap_reported || reported_gap_game_id != game_id
+					|| reported_gap_event != next_expected_event;
+			}
+		}
+
+		// Tell the server about missing events right away instead of waiting
+		// for the next regular heartbeat, so it can send them again sooner
+		if (new_gap)
+		{
+			std::uint32_t gap_game_id, gap_event;
+			{
+				std::lock_guard<std::recursive_mutex> _lock(events_lock);
+				gap_game_id = game_id;
+				gap_event = next_expected_event;
+			}
+			if (send_extra_heartbeat())
+			{
+				gap_reported = true;
+				reported_gap_game_id = gap_game_id;
+				reported_gap_event = gap_event;
 			}
 		}
 	}
@@ -241,45 +416,47 @@ void send_gui_job()
 
 		constexpr int BUFFER_SIZE = 2000;
 		char buffer[BUFFER_SIZE];
+		size_t new_game_idx = 0;
 		for (const auto& event : queued_events)
 		{
 			memset(buffer, 0x00, BUFFER_SIZE);
-			switch (event->event_type)
+			switch (event.event_type)
 			{
 			case NEW_GAME:
 			{
-				new_game* new_game = static_cast<struct new_game*>(event.get());
-				sprintf(buffer, "NEW_GAME %u %u ", new_game->maxx, new_game->maxy);
+				const new_game& new_game = event.new_game_data;
+				const auto& player_names = queued_player_names[new_game_idx++];
+				sprintf(buffer, "NEW_GAME %u %u ", new_game.maxx, new_game.maxy);
 				auto cur_buf = buffer + strlen(buffer);
-				for (size_t i = 0; i < new_game->player_names.size(); ++i)
+				for (size_t i = 0; i < player_names.size(); ++i)
 				{
-					const std::string& name = new_game->player_names[i];
+					const std::string& name = player_names[i];
 
 					sprintf(cur_buf, "%s", name.c_str());
 					cur_buf += name.size();
 					// Separate every player name but last
-					const bool is_last = (i + 1 == new_game->player_names.size());
+					const bool is_last = (i + 1 == player_names.size());
 					if (!is_last)
 						*(cur_buf++) = ' ';
 				}
 				// Every valid and complete message ends with \n
 				*cur_buf = '\n';
 
-				active_player_names = new_game->player_names;
-				maxx = new_game->maxx;
-				maxy = new_game->maxy;
+				active_player_names = player_names;
+				maxx = new_game.maxx;
+				maxy = new_game.maxy;
 				break;
 			}
 			case PIXEL:
 			{
-				pixel* pixel = static_cast<struct pixel*>(event.get());
-				sprintf(buffer, "PIXEL %u %u %s\n", pixel->x, pixel->y, active_player_names[pixel->player_number].c_str());
+				const pixel& pixel = event.pixel_data;
+				sprintf(buffer, "PIXEL %u %u %s\n", pixel.x, pixel.y, active_player_names[pixel.player_number].c_str());
 				break;
 			}
 			case PLAYER_ELIMINATED:
 			{
-				player_eliminated* elim = static_cast<player_eliminated*>(event.get());
-				sprintf(buffer, "PLAYER_ELIMINATED %s\n", active_player_names[elim->player_number].c_str());
+				const player_eliminated& elim = event.player_eliminated_data;
+				sprintf(buffer, "PLAYER_ELIMINATED %s\n", active_player_names[elim.player_number].c_str());
 				break;
 			}
 			default: break;
@@ -295,6 +472,7 @@ void send_gui_job()
 			fprintf(stderr, "GUI send: %s", buffer);
 		}
 		queued_events.clear();
+		queued_player_names.clear();
 	}
 }
 
@@ -354,8 +532,17 @@ void receive_gui_job()
 			}
 			pointer++;
 		}
-		// Update turn direction after change
-		turn_direction = (1 * key_pressed[0]) + (-1 * key_pressed[1]);
+		// Update turn direction after change and let the server know right
+		// away instead of with the next regular heartbeat
+		const std::int8_t new_turn_direction = (1 * key_pressed[0]) + (-1 * key_pressed[1]);
+		if (new_turn_direction != turn_direction)
+		{
+			const auto change_time = steady_clock::now();
+			std::unique_lock<std::mutex> lock(heartbeat_lock);
+			turn_direction = new_turn_direction;
+			key_send_delay.changed(change_time);
+			send_heartbeat_when_allowed(lock);
+		}
 	}
 }
 
@@ -28,9 +28,36 @@
 */
 
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
 
 #include "crc32.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+// ARMv8 CRC32 instructions are optional, so they're compiled in regardless
+// of -march and used if the kernel reports them (always if the compiler
+// targets them anyway); they compute the bit-reflected CRC, so data and
+// state are bit-reversed around them
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__) && \
+	defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_ARM_DISPATCH
+#include <arm_acle.h>
+#if defined(__linux__) && !defined(__ARM_FEATURE_CRC32)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#ifdef __clang__
+#define CRC32_ARM_TARGET __attribute__((target("crc")))
+#else
+#define CRC32_ARM_TARGET __attribute__((target("+crc")))
+#endif
+#endif
+
 /* This table was generated by the following program.
 
    #include <stdio.h>
@@ -164,10 +191,153 @@ make it easy to compose the values of multiple blocks.
 
 */
 
+namespace
+{
+  constexpr std::uint32_t CRC32_POLY = 0x04c11db7;
+
+  std::uint32_t load_be32(const unsigned char *buf)
+  {
+    return (std::uint32_t) buf[0] << 24 | (std::uint32_t) buf[1] << 16
+      | (std::uint32_t) buf[2] << 8 | (std::uint32_t) buf[3];
+  }
+
+  using slicing_tables = std::array<std::array<std::uint32_t, 256>, 8>;
+
+  /* slicing_table()[k][b] is the CRC of byte b followed by k zero bytes.
+     Built on first use, so xcrc32 works during static initialization of
+     other translation units as well.  */
+  const slicing_tables& slicing_table()
+  {
+    static const slicing_tables tables = []
+    {
+      slicing_tables table;
+      for (int b = 0; b < 256; ++b)
+        {
+          table[0][b] = crc32_table[b];
+          for (int k = 1; k < 8; ++k)
+            {
+              const std::uint32_t prev = table[k - 1][b];
+              table[k][b] = (prev << 8) ^ crc32_table[prev >> 24];
+            }
+        }
+      return table;
+    }();
+    return tables;
+  }
+
+#ifdef CRC32_X86_DISPATCH
+  /* x^n mod P, used as folding constants.  */
+  constexpr std::uint32_t xpow_mod(unsigned n)
+  {
+    std::uint32_t r = 1;
+    for (unsigned i = 0; i < n; ++i)
+      r = (r << 1) ^ ((r & 0x80000000) ? CRC32_POLY : 0);
+    return r;
+  }
+
+  /* Carry-less multiplication folding (see Intel's "Fast CRC Computation
+     for Generic Polynomials Using PCLMULQDQ Instruction").  Data is loaded
+     byte-reversed, so bit i of a 128-bit lane is the coefficient of x^i.
+     Folding lane X over D bits into the following data uses
+     X * x^D = X_hi * (x^(D+64) mod P) + X_lo * (x^D mod P).  */
+  __attribute__((target("pclmul,ssse3")))
+  __m128i fold(__m128i x, __m128i k)
+  {
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+      _mm_clmulepi64_si128(x, k, 0x00));
+  }
+
+  __attribute__((target("pclmul,ssse3")))
+  __m128i load_reversed(const unsigned char *buf, __m128i bswap)
+  {
+    return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buf)), bswap);
+  }
+
+  __attribute__((target("pclmul,ssse3")))
+  std::uint32_t crc32_pclmul_folding(const unsigned char *buf, size_t len, std::uint32_t crc)
+  {
+    constexpr size_t MIN_LEN = 64;
+    if (len < MIN_LEN)
+      return crc32_slicing8(buf, len, crc);
+
+    const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+      7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i k512 = _mm_set_epi64x(xpow_mod(512 + 64), xpow_mod(512));
+    const __m128i k128 = _mm_set_epi64x(xpow_mod(128 + 64), xpow_mod(128));
+
+    // Initial CRC value is equivalent to xoring it into the first 4 bytes
+    __m128i x0 = _mm_xor_si128(load_reversed(buf, bswap), _mm_set_epi32((int) crc, 0, 0, 0));
+    __m128i x1 = load_reversed(buf + 16, bswap);
+    __m128i x2 = load_reversed(buf + 32, bswap);
+    __m128i x3 = load_reversed(buf + 48, bswap);
+    buf += 64;
+    len -= 64;
+
+    for (; len >= 64; buf += 64, len -= 64)
+      {
+        x0 = _mm_xor_si128(fold(x0, k512), load_reversed(buf, bswap));
+        x1 = _mm_xor_si128(fold(x1, k512), load_reversed(buf + 16, bswap));
+        x2 = _mm_xor_si128(fold(x2, k512), load_reversed(buf + 32, bswap));
+        x3 = _mm_xor_si128(fold(x3, k512), load_reversed(buf + 48, bswap));
+      }
+
+    x1 = _mm_xor_si128(fold(x0, k128), x1);
+    x2 = _mm_xor_si128(fold(x1, k128), x2);
+    x3 = _mm_xor_si128(fold(x2, k128), x3);
+    for (; len >= 16; buf += 16, len -= 16)
+      x3 = _mm_xor_si128(fold(x3, k128), load_reversed(buf, bswap));
+
+    // Remaining 128 bits are congruent to everything processed so far, so
+    // reduce them as a regular 16 byte message and continue with the tail
+    unsigned char folded[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(folded), _mm_shuffle_epi8(x3, bswap));
+    crc = crc32_slicing8(folded, sizeof(folded), 0);
+    return crc32_slicing8(buf, len, crc);
+  }
+#endif
+
+#ifdef CRC32_ARM_DISPATCH
+  CRC32_ARM_TARGET
+  std::uint32_t crc32_arm_instructions(const unsigned char *buf, size_t len, std::uint32_t crc)
+  {
+    // Reflected CRC of bit-reversed bytes is the bit-reversed CRC
+    std::uint32_t reflected = __rbit(crc);
+    for (; len >= 8; buf += 8, len -= 8)
+      {
+        std::uint64_t data;
+        memcpy(&data, buf, sizeof(data));
+        reflected = __crc32d(reflected, __builtin_bswap64(__rbitll(data)));
+      }
+    return crc32_slicing8(buf, len, __rbit(reflected));
+  }
+#endif
+
+  using crc32_fn = std::uint32_t (*)(const unsigned char*, size_t, std::uint32_t);
+
+  crc32_fn select_crc32()
+  {
+#ifdef CRC32_ARM_DISPATCH
+    if (crc32_arm_supported())
+      return crc32_arm_instructions;
+#endif
+#ifdef CRC32_X86_DISPATCH
+    if (crc32_pclmul_supported())
+      return crc32_pclmul_folding;
+#endif
+    return crc32_slicing8;
+  }
+
+  /* Selected on first use for the same reason as slicing_table.  */
+  crc32_fn crc32_impl()
+  {
+    static const crc32_fn impl = select_crc32();
+    return impl;
+  }
+}
+
 std::uint32_t
-xcrc32(const unsigned char *buf, int len, std::uint32_t init)
+crc32_bytewise(const unsigned char *buf, size_t len, std::uint32_t crc)
 {
-  std::uint32_t crc = init;
   while (len--)
     {
       crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ *buf) & 255];
@@ -175,3 +345,69 @@ xcrc32(const unsigned char *buf, int len, std::uint32_t init)
     }
   return crc;
 }
+
+/* Slicing-by-8: processes 8 bytes per step with independent table lookups.  */
+std::uint32_t
+crc32_slicing8(const unsigned char *buf, size_t len, std::uint32_t crc)
+{
+  const auto& t = slicing_table();
+  for (; len >= 8; buf += 8, len -= 8)
+    {
+      const std::uint32_t hi = crc ^ load_be32(buf);
+      const std::uint32_t lo = load_be32(buf + 4);
+      crc = t[7][hi >> 24] ^ t[6][(hi >> 16) & 255]
+        ^ t[5][(hi >> 8) & 255] ^ t[4][hi & 255]
+        ^ t[3][lo >> 24] ^ t[2][(lo >> 16) & 255]
+        ^ t[1][(lo >> 8) & 255] ^ t[0][lo & 255];
+    }
+  return crc32_bytewise(buf, len, crc);
+}
+
+bool
+crc32_pclmul_supported()
+{
+#ifdef CRC32_X86_DISPATCH
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#else
+  return false;
+#endif
+}
+
+std::uint32_t
+crc32_pclmul(const unsigned char *buf, size_t len, std::uint32_t crc)
+{
+#ifdef CRC32_X86_DISPATCH
+  if (crc32_pclmul_supported())
+    return crc32_pclmul_folding(buf, len, crc);
+#endif
+  return crc32_slicing8(buf, len, crc);
+}
+
+bool
+crc32_arm_supported()
+{
+#if defined(CRC32_ARM_DISPATCH) && defined(__ARM_FEATURE_CRC32)
+  return true;
+#elif defined(CRC32_ARM_DISPATCH) && defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+  return false;
+#endif
+}
+
+std::uint32_t
+crc32_arm(const unsigned char *buf, size_t len, std::uint32_t crc)
+{
+#ifdef CRC32_ARM_DISPATCH
+  if (crc32_arm_supported())
+    return crc32_arm_instructions(buf, len, crc);
+#endif
+  return crc32_slicing8(buf, len, crc);
+}
+
+std::uint32_t
+xcrc32(const unsigned char *buf, int len, std::uint32_t init)
+{
+  return crc32_impl()(buf, len, init);
+}
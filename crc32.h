@@ -1,5 +1,15 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 
-std::uint32_t xcrc32(const unsigned char *buf, int len, std::uint32_t init);
\ No newline at end of file
+std::uint32_t xcrc32(const unsigned char *buf, int len, std::uint32_t init);
+
+// Implementations xcrc32 picks from, fastest one the CPU supports is used.
+// SIMD ones fall back to crc32_slicing8 if they aren't supported.
+std::uint32_t crc32_bytewise(const unsigned char *buf, size_t len, std::uint32_t crc);
+std::uint32_t crc32_slicing8(const unsigned char *buf, size_t len, std::uint32_t crc);
+bool crc32_pclmul_supported();
+std::uint32_t crc32_pclmul(const unsigned char *buf, size_t len, std::uint32_t crc);
+bool crc32_arm_supported();
+std::uint32_t crc32_arm(const unsigned char *buf, size_t len, std::uint32_t crc);
@@ -0,0 +1,182 @@
+#include "event_log.h"
+
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+constexpr size_t event_log::MAX_CACHED_RUNS;
+
+namespace
+{
+	// Bounds the delay of serializing PIXEL events if nobody asks for them
+	constexpr size_t MAX_PENDING_PIXELS = 64;
+}
+
+void event_log::append(const event& event, const std::vector<std::string>& player_names/* = {}*/)
+{
+	if (event.event_type == PIXEL)
+	{
+		m_pending_pixels.push_back(event);
+		if (m_pending_pixels.size() >= MAX_PENDING_PIXELS)
+			flush();
+		return;
+	}
+
+	flush();
+	const size_t start = m_bytes.size();
+	m_offsets.push_back(static_cast<std::uint32_t>(start));
+	// Log keeps its capacity between games, so this rarely allocates
+	m_bytes.resize(start + event.calculate_total_len_with_crc32(player_names));
+	event.serialize(m_bytes.data() + start, m_bytes.size() - start, player_names);
+}
+
+void event_log::clear()
+{
+	m_bytes.clear();
+	m_offsets.clear();
+	m_pending_pixels.clear();
+	m_cache.clear();
+	m_lru.clear();
+}
+
+void event_log::flush()
+{
+	if (m_pending_pixels.empty())
+		return;
+
+	const size_t start = m_bytes.size();
+	const size_t count = m_pending_pixels.size();
+	m_bytes.resize(start + count * PIXEL_EVENT_LEN);
+	serialize_pixel_events(m_pending_pixels.data(), count, m_bytes.data() + start);
+	for (size_t i = 0; i < count; ++i)
+		m_offsets.push_back(static_cast<std::uint32_t>(start + i * PIXEL_EVENT_LEN));
+
+	m_pending_pixels.clear();
+}
+
+size_t event_log::size() const
+{
+	return m_offsets.size() + m_pending_pixels.size();
+}
+
+const std::uint8_t* event_log::data(size_t event_no) const
+{
+	return m_bytes.data() + m_offsets[event_no];
+}
+
+size_t event_log::length(size_t event_no, size_t count/* = 1*/) const
+{
+	const size_t end = event_no + count;
+	const size_t end_offset = end < m_offsets.size() ? m_offsets[end] : m_bytes.size();
+	return end_offset - m_offsets[event_no];
+}
+
+size_t event_log::count_within(size_t event_no, size_t max_count, size_t max_bytes)
+{
+	flush();
+	if (event_no >= size())
+		return 0;
+
+	max_count = std::min(size() - event_no, max_count);
+	if (length(event_no, max_count) <= max_bytes)
+		return max_count;
+
+	// Offsets only grow, so find the first event which ends past max_bytes
+	const auto first = m_offsets.begin() + event_no;
+	const auto past = std::upper_bound(first + 1, first + max_count,
+		static_cast<std::uint64_t>(*first) + max_bytes,
+		[](std::uint64_t limit, std::uint32_t offset) { return limit < offset; });
+	return (past - first) - 1;
+}
+
+datagram_slice event_log::datagrams(std::uint32_t game_id, size_t event_no, size_t max_count)
+{
+	flush();
+	if (event_no >= size() || max_count == 0)
+		return datagram_slice { nullptr, 0, 0, 0 };
+
+	const size_t count = std::min(size() - event_no, max_count);
+
+	auto it = m_cache.find(event_no);
+	if (it != m_cache.end())
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru_position);
+	else
+	{
+		if (m_cache.size() >= MAX_CACHED_RUNS)
+		{
+			m_cache.erase(m_lru.back());
+			m_lru.pop_back();
+		}
+		m_lru.push_front(event_no);
+		it = m_cache.emplace(event_no, cached_run { nullptr, game_id, 0, {}, m_lru.begin() }).first;
+	}
+
+	// Events never change and datagrams are packed greedily, so a run with
+	// more events starts with the same datagrams. It has to be rebuilt only
+	// if it ended at the end of the log and client now wants newer events.
+	cached_run& cached = it->second;
+	if (cached.run == nullptr || cached.game_id != game_id || cached.event_count < count)
+	{
+		cached.run = build_datagrams(game_id, event_no, count, cached.datagram_ends);
+		cached.game_id = game_id;
+		cached.event_count = count;
+	}
+
+	const auto& ends = cached.datagram_ends;
+	const size_t datagram_count = std::upper_bound(ends.begin(), ends.end(), count) - ends.begin();
+	if (datagram_count == 0)
+	{
+		// Even the first cached datagram is too big, client is rarely
+		// limited to that few events, so this one isn't cached
+		std::vector<size_t> own_ends;
+		auto run = build_datagrams(game_id, event_no, count, own_ends);
+		return datagram_slice { run, run->datagram_count(), count, run->data.size() };
+	}
+
+	const auto& sizes = cached.run->sizes;
+	const size_t length = std::accumulate(sizes.begin(), sizes.begin() + datagram_count, size_t(0));
+	return datagram_slice { cached.run, datagram_count, ends[datagram_count - 1], length };
+}
+
+std::shared_ptr<datagram_run> event_log::build_datagrams(std::uint32_t game_id,
+	size_t event_no, size_t count, std::vector<size_t>& datagram_ends) const
+{
+	auto run = std::make_shared<datagram_run>();
+	run->data.reserve(length(event_no, count) + (count / 2 + 1) * sizeof(game_id));
+	datagram_ends.clear();
+
+	const size_t first = event_no;
+
+	const std::uint32_t header = htonl(game_id);
+	const size_t end = event_no + count;
+	while (event_no < end)
+	{
+		// Pack as many consecutive events as fit in a single server_message
+		size_t last = event_no;
+		size_t events_len = 0;
+		for (; last < end; ++last)
+		{
+			const size_t event_len = length(last);
+			if (events_len + event_len > server_message::MAX_EVENTS_LEN)
+				break;
+			events_len += event_len;
+		}
+
+		const size_t start = run->data.size();
+		run->data.resize(start + sizeof(header) + events_len);
+		memcpy(run->data.data() + start, &header, sizeof(header));
+		memcpy(run->data.data() + start + sizeof(header), data(event_no), events_len);
+		run->sizes.push_back(static_cast<std::uint16_t>(sizeof(header) + events_len));
+		datagram_ends.push_back(last - first);
+
+		event_no = last;
+	}
+
+	return run;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <list>
+#include <unordered_map>
+
+#include "protocol.h"
+#include "batch_io.h"
+
+// First datagrams of a shared run, which hold event_count events
+struct datagram_slice
+{
+	std::shared_ptr<const datagram_run> run;
+	size_t datagram_count;
+	size_t event_count;
+	size_t length; // bytes of these datagrams
+};
+
+// Events of a single game, serialized (with CRC) once when they're generated
+// and stored back to back, so datagrams can be built with plain memcpy.
+// Consecutive PIXEL events are held back and serialized together in a batch
+// when anything else is appended or datagrams are requested.
+// Built datagrams are cached by starting event, so clients waiting for the
+// same events share a single buffer, even if they can take different number
+// of them. Only the most recently used runs are
+// kept, since clients keep moving forward and old runs are rarely needed again.
+class event_log
+{
+public:
+	// player_names are only needed for NEW_GAME
+	void append(const event& event, const std::vector<std::string>& player_names = {});
+	void clear();
+	// Serializes held back PIXEL events
+	void flush();
+
+	// Number of events in the log, which is also event_no of the next one
+	size_t size() const;
+	// Only valid for events serialized before the last flush
+	const std::uint8_t* data(size_t event_no) const;
+	// Serialized length of count events starting with event_no
+	size_t length(size_t event_no, size_t count = 1) const;
+	// How many of up to max_count events starting with event_no fit (serialized)
+	// in max_bytes
+	size_t count_within(size_t event_no, size_t max_count, size_t max_bytes);
+
+	// Returns whole server_message datagrams with up to max_count events
+	// starting with event_no (run is nullptr if there are none). Datagrams
+	// are cut where a run with more events would cut them, so there may be
+	// fewer than max_count events if that doesn't fall on their boundary.
+	datagram_slice datagrams(std::uint32_t game_id, size_t event_no, size_t max_count);
+
+private:
+	struct cached_run
+	{
+		std::shared_ptr<const datagram_run> run;
+		std::uint32_t game_id;
+		size_t event_count;
+		std::vector<size_t> datagram_ends; // events held by datagrams up to each one
+		std::list<std::uint64_t>::iterator lru_position;
+	};
+
+	// Enough for every client (at most 42 players and a few spectators) to
+	// have its own run
+	constexpr static size_t MAX_CACHED_RUNS = 128;
+
+	std::shared_ptr<datagram_run> build_datagrams(std::uint32_t game_id,
+		size_t event_no, size_t count, std::vector<size_t>& datagram_ends) const;
+
+	std::vector<std::uint8_t> m_bytes;
+	std::vector<std::uint32_t> m_offsets; // where each event starts in m_bytes
+	std::vector<event> m_pending_pixels; // not serialized yet
+	// Keyed by event_no, run holds the most events any client asked for
+	std::unordered_map<std::uint64_t, cached_run> m_cache;
+	std::list<std::uint64_t> m_lru; // cache keys, most recently used first
+};
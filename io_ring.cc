@@ -0,0 +1,223 @@
+#ifdef HAVE_IO_URING
+#include "io_ring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+	int io_uring_setup(unsigned entries, io_uring_params* params)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+	}
+
+	int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+			min_complete, flags, nullptr, 0));
+	}
+
+	int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+	}
+
+	template<typename T>
+	T load_acquire(const T* ptr)
+	{
+		return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+	}
+
+	template<typename T>
+	void store_release(T* ptr, T value)
+	{
+		__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+	}
+
+	template<typename T>
+	T* offset_ptr(void* base, size_t offset)
+	{
+		return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+	}
+}
+
+io_ring::~io_ring()
+{
+	if (m_buffers)
+		munmap(m_buffers, m_buf_count * m_buffer_size);
+	if (m_buf_ring)
+		munmap(m_buf_ring, m_buf_ring_size);
+	if (m_sqes)
+		munmap(m_sqes, m_sqes_size);
+	if (m_cq_ptr && m_cq_ptr != m_ring_ptr)
+		munmap(m_cq_ptr, m_cq_size);
+	if (m_ring_ptr)
+		munmap(m_ring_ptr, m_ring_size);
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+bool io_ring::init(unsigned entries)
+{
+	io_uring_params params;
+	memset(&params, 0x00, sizeof(params));
+
+	m_fd = io_uring_setup(entries, &params);
+	if (m_fd < 0)
+		return false;
+
+	m_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+		m_ring_size = m_cq_size = std::max(m_ring_size, m_cq_size);
+
+	m_ring_ptr = mmap(nullptr, m_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_ring_ptr == MAP_FAILED)
+	{
+		m_ring_ptr = nullptr;
+		return false;
+	}
+
+	m_cq_ptr = m_ring_ptr;
+	if (!single_mmap)
+	{
+		m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if (m_cq_ptr == MAP_FAILED)
+		{
+			m_cq_ptr = nullptr;
+			return false;
+		}
+	}
+
+	m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+	m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+	m_sq_head = offset_ptr<unsigned>(m_ring_ptr, params.sq_off.head);
+	m_sq_tail = offset_ptr<unsigned>(m_ring_ptr, params.sq_off.tail);
+	m_sq_mask = *offset_ptr<unsigned>(m_ring_ptr, params.sq_off.ring_mask);
+	m_sq_entries = *offset_ptr<unsigned>(m_ring_ptr, params.sq_off.ring_entries);
+	m_sq_array = offset_ptr<unsigned>(m_ring_ptr, params.sq_off.array);
+	m_sqe_tail = *m_sq_tail;
+
+	m_cq_head = offset_ptr<unsigned>(m_cq_ptr, params.cq_off.head);
+	m_cq_tail = offset_ptr<unsigned>(m_cq_ptr, params.cq_off.tail);
+	m_cq_mask = *offset_ptr<unsigned>(m_cq_ptr, params.cq_off.ring_mask);
+	m_cqes = offset_ptr<io_uring_cqe>(m_cq_ptr, params.cq_off.cqes);
+
+	return true;
+}
+
+io_uring_sqe* io_ring::get_sqe()
+{
+	if (m_sqe_tail - load_acquire(m_sq_head) >= m_sq_entries)
+	{
+		if (submit_and_wait(0) < 0)
+			return nullptr;
+		if (m_sqe_tail - load_acquire(m_sq_head) >= m_sq_entries)
+			return nullptr;
+	}
+
+	const unsigned index = m_sqe_tail & m_sq_mask;
+	io_uring_sqe* sqe = &m_sqes[index];
+	memset(sqe, 0x00, sizeof(*sqe));
+	m_sq_array[index] = index;
+	m_sqe_tail++;
+	return sqe;
+}
+
+int io_ring::submit_and_wait(unsigned wait_nr)
+{
+	const unsigned to_submit = m_sqe_tail - *m_sq_tail;
+	store_release(m_sq_tail, m_sqe_tail);
+
+	int ret;
+	do
+	{
+		ret = io_uring_enter(m_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+io_uring_cqe* io_ring::peek_cqe()
+{
+	const unsigned head = *m_cq_head;
+	if (head == load_acquire(m_cq_tail))
+		return nullptr;
+
+	return &m_cqes[head & m_cq_mask];
+}
+
+void io_ring::cqe_seen()
+{
+	store_release(m_cq_head, *m_cq_head + 1);
+}
+
+bool io_ring::setup_buffer_ring(std::uint16_t group, unsigned count, size_t buffer_size)
+{
+	m_buf_count = count;
+	m_buffer_size = buffer_size;
+
+	m_buf_ring_size = count * sizeof(io_uring_buf);
+	void* ring = mmap(nullptr, m_buf_ring_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ring == MAP_FAILED)
+		return false;
+	m_buf_ring = static_cast<io_uring_buf_ring*>(ring);
+
+	void* buffers = mmap(nullptr, count * buffer_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (buffers == MAP_FAILED)
+		return false;
+	m_buffers = static_cast<std::uint8_t*>(buffers);
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0x00, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<std::uint64_t>(m_buf_ring);
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if (io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return false;
+
+	for (unsigned id = 0; id < count; ++id)
+		recycle_buffer(static_cast<std::uint16_t>(id));
+
+	return true;
+}
+
+std::uint8_t* io_ring::buffer(std::uint16_t id) const
+{
+	return m_buffers + id * m_buffer_size;
+}
+
+size_t io_ring::buffer_size() const
+{
+	return m_buffer_size;
+}
+
+void io_ring::recycle_buffer(std::uint16_t id)
+{
+	// Ring tail overlays reserved field of the first buffer entry. Entries
+	// start right at the beginning of the ring, but bufs is declared with
+	// __DECLARE_FLEX_ARRAY, whose empty struct member moves it 8 bytes further
+	// in C++, so it can't be used
+	const std::uint16_t tail = m_buf_ring->tail;
+	io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(m_buf_ring);
+	io_uring_buf& buf = bufs[tail & (m_buf_count - 1)];
+	buf.addr = reinterpret_cast<std::uint64_t>(buffer(id));
+	buf.len = static_cast<std::uint32_t>(m_buffer_size);
+	buf.bid = id;
+	store_release(&m_buf_ring->tail, static_cast<std::uint16_t>(tail + 1));
+}
+#endif // HAVE_IO_URING
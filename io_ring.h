@@ -0,0 +1,68 @@
+#pragma once
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <cstdint>
+#include <cstddef>
+
+// Minimal io_uring wrapper on top of raw syscalls, supporting only what the
+// server needs: submission/completion queues and a provided buffer ring
+class io_ring
+{
+public:
+	io_ring() = default;
+	~io_ring();
+	io_ring(const io_ring&) = delete;
+	io_ring& operator=(const io_ring&) = delete;
+
+	// Returns false if io_uring isn't available (old kernel, seccomp etc.)
+	bool init(unsigned entries);
+
+	// Returns next free, zeroed submission entry; submits pending entries
+	// first if the submission queue is full
+	io_uring_sqe* get_sqe();
+	// Submits pending entries and waits for at least wait_nr completions
+	int submit_and_wait(unsigned wait_nr);
+
+	// Returns next completion or nullptr if there's none, completion has to
+	// be marked as consumed with cqe_seen() afterwards
+	io_uring_cqe* peek_cqe();
+	void cqe_seen();
+
+	// Registers ring of count (power of 2) buffers, buffer_size bytes each,
+	// which kernel picks from for operations with IOSQE_BUFFER_SELECT
+	bool setup_buffer_ring(std::uint16_t group, unsigned count, size_t buffer_size);
+	std::uint8_t* buffer(std::uint16_t id) const;
+	size_t buffer_size() const;
+	// Gives buffer back to the kernel after its data was consumed
+	void recycle_buffer(std::uint16_t id);
+
+private:
+	int m_fd = -1;
+
+	void* m_ring_ptr = nullptr;
+	size_t m_ring_size = 0;
+	void* m_cq_ptr = nullptr;
+	size_t m_cq_size = 0;
+	io_uring_sqe* m_sqes = nullptr;
+	size_t m_sqes_size = 0;
+
+	unsigned* m_sq_head = nullptr;
+	unsigned* m_sq_tail = nullptr;
+	unsigned m_sq_mask = 0;
+	unsigned m_sq_entries = 0;
+	unsigned* m_sq_array = nullptr;
+	unsigned m_sqe_tail = 0; // locally prepared, not yet published entries
+
+	unsigned* m_cq_head = nullptr;
+	unsigned* m_cq_tail = nullptr;
+	unsigned m_cq_mask = 0;
+	io_uring_cqe* m_cqes = nullptr;
+
+	io_uring_buf_ring* m_buf_ring = nullptr;
+	size_t m_buf_ring_size = 0;
+	unsigned m_buf_count = 0;
+	std::uint8_t* m_buffers = nullptr;
+	size_t m_buffer_size = 0;
+};
+#endif // HAVE_IO_URING
@@ -1,9 +1,24 @@
 #include "map.h"
+#include <algorithm>
+
+namespace
+{
+	constexpr std::uint64_t WORD_BITS = 64;
+	static_assert(map::TILE_SIZE == WORD_BITS, "Tile row has to fit in a single word");
+}
+
+map::map()
+: map(DEFAULT_WIDTH, DEFAULT_HEIGHT)
+{
+}
 
 map::map(std::uint32_t _width, std::uint32_t _height)
 : width(_width)
 , height(_height)
+, sparse(static_cast<std::uint64_t>(_width) * _height > MAX_DENSE_PIXELS)
 {
+    if (!sparse)
+        pixels.resize((static_cast<std::uint64_t>(width) * height + WORD_BITS - 1) / WORD_BITS);
 }
 
 bool map::is_inside(const position_t& pos) const
@@ -18,13 +33,69 @@ bool map::is_inside(double x, double y) const
 
 bool map::is_occupied(const position_t& pos) const
 {
-    return pixels.find(pos) != pixels.end();
+    if (!is_inside(pos))
+        return false;
+
+    if (sparse)
+    {
+        const auto it = tiles.find(tile_id(pos));
+        if (it == tiles.end())
+            return false;
+
+        return (it->second[pos.second % TILE_SIZE] >> (pos.first % TILE_SIZE)) & 1;
+    }
+
+    const auto index = bit_index(pos);
+    return (pixels[index / WORD_BITS] >> (index % WORD_BITS)) & 1;
 }
 
 bool map::is_occupied(double x, double y) const
 {
     return is_occupied(make_pos(x, y));
 }
+
+bool map::set_occupied(const position_t& pos)
+{
+    if (!is_inside(pos))
+        return false;
+
+    std::uint64_t* word;
+    std::uint64_t mask;
+    if (sparse)
+    {
+        // Value-initialized (zeroed) tile is created on first touch
+        word = &tiles[tile_id(pos)][pos.second % TILE_SIZE];
+        mask = std::uint64_t(1) << (pos.first % TILE_SIZE);
+    }
+    else
+    {
+        const auto index = bit_index(pos);
+        word = &pixels[index / WORD_BITS];
+        mask = std::uint64_t(1) << (index % WORD_BITS);
+    }
+
+    const bool was_occupied = (*word & mask) != 0;
+    *word |= mask;
+    return was_occupied;
+}
+
+void map::clear()
+{
+    std::fill(pixels.begin(), pixels.end(), 0);
+    tiles.clear();
+}
+
+std::uint64_t map::bit_index(const position_t& pos) const
+{
+    return static_cast<std::uint64_t>(pos.second) * width + pos.first;
+}
+
+/* static */
+std::uint64_t map::tile_id(const position_t& pos)
+{
+    return (static_cast<std::uint64_t>(pos.second / TILE_SIZE) << 32) | (pos.first / TILE_SIZE);
+}
+
 /* static */
 map::position_t map::make_pos(double x, double y)
 {
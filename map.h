@@ -1,22 +1,48 @@
 #pragma once
 #include <utility>
 #include <cstdint>
-#include <set>
+#include <vector>
+#include <array>
+#include <unordered_map>
 
 struct map {
 	using position_t = std::pair<std::uint32_t, std::uint32_t>;
 
-	std::uint32_t width = 800;
-	std::uint32_t height = 600;
-	std::set<position_t> pixels;
+	// Boards with more pixels than that use sparse tiles instead of a dense
+	// bitmap (2^27 pixels is a 16 MiB bitmap)
+	constexpr static std::uint64_t MAX_DENSE_PIXELS = std::uint64_t(1) << 27;
+	constexpr static std::uint32_t TILE_SIZE = 64; // tile is TILE_SIZE x TILE_SIZE px
 
-	map() = default;
+	// One 64-bit word per tile row
+	using tile_t = std::array<std::uint64_t, TILE_SIZE>;
+
+	constexpr static std::uint32_t DEFAULT_WIDTH = 800;
+	constexpr static std::uint32_t DEFAULT_HEIGHT = 600;
+
+	std::uint32_t width;
+	std::uint32_t height;
+	bool sparse = false;
+	// Dense occupancy bitmap, row-major, one bit per pixel packed into 64-bit words
+	std::vector<std::uint64_t> pixels;
+	// Sparse occupancy, tiles are allocated when first touched and keyed by tile id
+	std::unordered_map<std::uint64_t, tile_t> tiles;
+
+	// Empty DEFAULT_WIDTH x DEFAULT_HEIGHT board
+	map();
 	map(std::uint32_t _width, std::uint32_t _height);
 	bool is_inside(const position_t& pos) const;
 	bool is_inside(double x, double y) const;
 
 	bool is_occupied(const position_t& pos) const;
 	bool is_occupied(double x, double y) const;
+	// Marks pixel as occupied, returns whether it was already occupied before
+	bool set_occupied(const position_t& pos);
+	// Frees every pixel on the board (dense bitmap is reused, tiles are dropped)
+	void clear();
 
     static position_t make_pos(double x, double y);
+
+private:
+	std::uint64_t bit_index(const position_t& pos) const;
+	static std::uint64_t tile_id(const position_t& pos);
 };
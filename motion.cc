@@ -0,0 +1,177 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <array>
+#include <utility>
+
+#include "motion.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MOTION_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace
+{
+	// Rotation are degrees going clock-wise, so negate deg for (cos deg, sin deg) unit vector
+	std::pair<double, double> calculate_direction(double rotation)
+	{
+		return std::make_pair(cos(-rotation * M_PI / 180), sin(-rotation * M_PI / 180));
+	}
+
+	// Rotation starts as an integer and changes by integer turning speed, so after
+	// fmod it's always an integer in (-360; 360). Cache unit vectors for all of
+	// these, calculated exactly the same way, so movement stays bit-identical.
+	constexpr int MAX_TABLE_ROTATION = 359;
+	const auto direction_table = []
+	{
+		std::array<std::pair<double, double>, 2 * MAX_TABLE_ROTATION + 1> table;
+		for (int rotation = -MAX_TABLE_ROTATION; rotation <= MAX_TABLE_ROTATION; ++rotation)
+			table[rotation + MAX_TABLE_ROTATION] = calculate_direction(rotation);
+
+		return table;
+	}();
+
+	std::pair<double, double> direction_vector(double rotation)
+	{
+		const bool is_integer = rotation == std::trunc(rotation);
+		if (is_integer && std::abs(rotation) <= MAX_TABLE_ROTATION)
+			return direction_table[static_cast<int>(rotation) + MAX_TABLE_ROTATION];
+
+		// Shouldn't happen, but don't break in case of non-integer angles
+		return calculate_direction(rotation);
+	}
+
+	// Pixel changes iff truncated coordinate changes, which is what
+	// map::make_pos does (coordinates only change by less than a unit)
+	void advance_positions_scalar(double* x, double* y, const double* dx,
+		const double* dy, std::uint8_t* moved, size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const double old_x = std::trunc(x[i]);
+			const double old_y = std::trunc(y[i]);
+			x[i] += dx[i];
+			y[i] += dy[i];
+			moved[i] = old_x != std::trunc(x[i]) || old_y != std::trunc(y[i]);
+		}
+	}
+
+	using advance_positions_fn = void (*)(double*, double*, const double*,
+		const double*, std::uint8_t*, size_t);
+
+	void advance_positions_generic(double* x, double* y, const double* dx,
+		const double* dy, std::uint8_t* moved, size_t count)
+	{
+		advance_positions_scalar(x, y, dx, dy, moved, 0, count);
+	}
+
+#ifdef MOTION_X86_DISPATCH
+	__attribute__((target("sse4.1")))
+	void advance_positions_sse41(double* x, double* y, const double* dx,
+		const double* dy, std::uint8_t* moved, size_t count)
+	{
+		constexpr int TRUNCATE = _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC;
+
+		size_t i = 0;
+		for (; i + 2 <= count; i += 2)
+		{
+			const __m128d px = _mm_loadu_pd(x + i);
+			const __m128d py = _mm_loadu_pd(y + i);
+			const __m128d nx = _mm_add_pd(px, _mm_loadu_pd(dx + i));
+			const __m128d ny = _mm_add_pd(py, _mm_loadu_pd(dy + i));
+			_mm_storeu_pd(x + i, nx);
+			_mm_storeu_pd(y + i, ny);
+
+			const __m128d same = _mm_and_pd(
+				_mm_cmpeq_pd(_mm_round_pd(px, TRUNCATE), _mm_round_pd(nx, TRUNCATE)),
+				_mm_cmpeq_pd(_mm_round_pd(py, TRUNCATE), _mm_round_pd(ny, TRUNCATE)));
+			const int same_mask = _mm_movemask_pd(same);
+			moved[i] = !(same_mask & 1);
+			moved[i + 1] = !(same_mask & 2);
+		}
+		advance_positions_scalar(x, y, dx, dy, moved, i, count);
+	}
+
+	__attribute__((target("avx")))
+	void advance_positions_avx(double* x, double* y, const double* dx,
+		const double* dy, std::uint8_t* moved, size_t count)
+	{
+		constexpr int TRUNCATE = _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC;
+
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			const __m256d px = _mm256_loadu_pd(x + i);
+			const __m256d py = _mm256_loadu_pd(y + i);
+			const __m256d nx = _mm256_add_pd(px, _mm256_loadu_pd(dx + i));
+			const __m256d ny = _mm256_add_pd(py, _mm256_loadu_pd(dy + i));
+			_mm256_storeu_pd(x + i, nx);
+			_mm256_storeu_pd(y + i, ny);
+
+			const __m256d same = _mm256_and_pd(
+				_mm256_cmp_pd(_mm256_round_pd(px, TRUNCATE), _mm256_round_pd(nx, TRUNCATE), _CMP_EQ_OQ),
+				_mm256_cmp_pd(_mm256_round_pd(py, TRUNCATE), _mm256_round_pd(ny, TRUNCATE), _CMP_EQ_OQ));
+			const int same_mask = _mm256_movemask_pd(same);
+			for (int lane = 0; lane < 4; ++lane)
+				moved[i + lane] = !((same_mask >> lane) & 1);
+		}
+		advance_positions_scalar(x, y, dx, dy, moved, i, count);
+	}
+#endif
+
+	advance_positions_fn select_advance_positions()
+	{
+#ifdef MOTION_X86_DISPATCH
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx"))
+			return advance_positions_avx;
+		if (__builtin_cpu_supports("sse4.1"))
+			return advance_positions_sse41;
+#endif
+		return advance_positions_generic;
+	}
+
+	const advance_positions_fn advance_positions = select_advance_positions();
+}
+
+size_t player_motion::size() const
+{
+	return x.size();
+}
+
+void player_motion::resize(size_t count)
+{
+	x.resize(count);
+	y.resize(count);
+	rotation.resize(count);
+	turn_direction.resize(count);
+	moved.resize(count);
+	dx.resize(count);
+	dy.resize(count);
+}
+
+void player_motion::clear()
+{
+	resize(0);
+}
+
+void player_motion::advance(std::uint32_t turning_speed)
+{
+	const size_t count = size();
+	for (size_t i = 0; i < count; ++i)
+	{
+		rotation[i] += turn_direction[i] * turning_speed;
+		rotation[i] = fmod(rotation[i], 360);
+
+		const auto direction = direction_vector(rotation[i]);
+		dx[i] = direction.first;
+		dy[i] = direction.second;
+	}
+
+	advance_positions(x.data(), y.data(), dx.data(), dy.data(), moved.data(), count);
+}
+
+map::position_t player_motion::position(size_t player) const
+{
+	return map::make_pos(x[player], y[player]);
+}
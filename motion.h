@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "map.h"
+
+// Hot movement state of players in the current game, kept in separate
+// contiguous arrays indexed by player id, so all players can be advanced in
+// a single pass. Cold data (names, connections) stays in server_player.
+struct player_motion
+{
+	std::vector<double> x;
+	std::vector<double> y;
+	std::vector<double> rotation; // in degrees, clockwise, 0* = right
+	std::vector<std::uint8_t> turn_direction;
+	// Set by advance() for players that moved onto a different pixel
+	std::vector<std::uint8_t> moved;
+
+	size_t size() const;
+	void resize(size_t count);
+	void clear();
+
+	// Rotates every player by its turn direction and moves it by a unit
+	void advance(std::uint32_t turning_speed);
+	map::position_t position(size_t player) const;
+
+private:
+	// Scratch space for per-tick direction vectors
+	std::vector<double> dx;
+	std::vector<double> dy;
+};
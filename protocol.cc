@@ -8,370 +8,642 @@
 #include <memory>
 #include <iterator>
 #include <utility>
-#include <cassert>
 #include <algorithm>
 
-#ifdef _WIN32
-#define NOMINMAX
-#pragma comment(lib, "Ws2_32.lib")
-#include <WinSock2.h> // endianness helpers
-#else
-#include <arpa/inet.h>
-#include <sys/types.h>
-#define _BSD_SOURCE
-#include <endian.h> // TODO: Verify
-#define htonll htobe64
-#define ntohll be64toh
-#endif
-
 #include "util.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PROTOCOL_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
 namespace
 {
-	inline std::uint64_t hton(std::uint64_t val) { return htonll(val); }
-	inline std::uint32_t hton(std::uint32_t val) { return htonl(val); }
-	inline std::uint16_t hton(std::uint16_t val) { return htons(val); }
-	inline std::uint8_t hton(std::uint8_t val) { return val; }
-	inline std::int8_t hton(std::int8_t val) { return val; }
+	using schema::load_be;
 
-	inline std::uint64_t ntoh(std::uint64_t val) { return ntohll(val); }
-	inline std::uint32_t ntoh(std::uint32_t val) { return ntohl(val); }
-	inline std::uint16_t ntoh(std::uint16_t val) { return ntohs(val); }
-	inline std::uint8_t ntoh(std::uint8_t val) { return val; }
-	inline std::int8_t ntoh(std::int8_t val) { return val; }
+	static_assert(event_header_layout::size == event::HEADER_LEN,
+		"Event header layout doesn't match HEADER_LEN");
+	static_assert(client_message_layout::size + sizeof(client_message::player_name)
+		== client_message::MAX_LEN, "Client message layout doesn't match MAX_LEN");
 
-	template<typename T>
-	bool consume_bytes(const std::uint8_t* stream, size_t len, const std::uint8_t*& pointer, T& destination)
+	size_t player_names_len(const std::vector<std::string>& player_names)
 	{
-		assert(len == 0 || (pointer >= stream && pointer < stream + len));
-		// Not enough data in the stream
-		if (pointer + sizeof(T) > stream + len)
-			return false;
-
-		destination = ntoh(*reinterpret_cast<const T*>(pointer));
-		pointer += sizeof(T);
-		return true;
+		size_t len = 0;
+		for (const auto& name : player_names)
+			len += name.length() + sizeof('\0');
+		return len;
 	}
 
-	template<typename T>
-	auto as_bytes(const T& data)
+	// Size of the serialized event data of an already validated event
+	size_t event_data_len(const std::uint8_t* event)
 	{
-		return reinterpret_cast<const std::uint8_t(*)[sizeof(data)]>(&data);
+		switch (event_header_layout::get<1>(event))
+		{
+		case NEW_GAME: return event_header_layout::get<0>(event) - sizeof(event::event_no) - sizeof(event::event_type);
+		case PIXEL: return pixel_layout::size;
+		case PLAYER_ELIMINATED: return player_eliminated_layout::size;
+		case GAME_OVER: return game_over_layout::size;
+		default: return 0;
+		}
 	}
 
-	template<typename T>
-	void append_bytes(std::vector<std::uint8_t>& stream, T bytes)
+	// Validates player names region of NEW_GAME, i.e. every name is non-empty,
+	// at most 64 chars long and '\0'-terminated within the region
+	bool validate_player_names(const std::uint8_t* buf, size_t len)
 	{
-		stream.insert(stream.end(), std::begin(*bytes), std::end(*bytes));
+		const std::uint8_t* pointer = buf;
+		while (pointer < buf + len)
+		{
+			const void* name_end = memchr(pointer, '\0', buf + len - pointer);
+			// Name extends message length or isn't 0-separated
+			if (name_end == nullptr)
+				return false;
+
+			const size_t name_len = static_cast<const std::uint8_t*>(name_end) - pointer;
+			// Invalid name length
+			if (name_len <= 0 || name_len > 64)
+				return false;
+
+			pointer += name_len + sizeof('\0');
+		}
+
+		return true;
 	}
+}
 
-	void append_string(std::vector<std::uint8_t>& stream, const char* str)
+event::event() : event_type(UNKNOWN) {}
+event::event(const struct new_game& data) : event_type(NEW_GAME), new_game_data(data) {}
+event::event(const struct pixel& data) : event_type(PIXEL), pixel_data(data) {}
+event::event(const struct player_eliminated& data)
+: event_type(PLAYER_ELIMINATED)
+, player_eliminated_data(data)
+{
+}
+event::event(const struct game_over& data) : event_type(GAME_OVER), game_over_data(data) {}
+
+std::uint32_t event::calculate_len(const std::vector<std::string>& player_names/* = {}*/) const
+{
+	std::uint32_t event_data_len = 0;
+	switch (event_type)
 	{
-		stream.insert(stream.end(), str, str + strlen(str));
+	case NEW_GAME: event_data_len = new_game_layout::size + player_names_len(player_names); break;
+	case PIXEL: event_data_len = pixel_layout::size; break;
+	case PLAYER_ELIMINATED: event_data_len = player_eliminated_layout::size; break;
+	case GAME_OVER: event_data_len = game_over_layout::size; break;
+	default: break;
 	}
 
-	std::shared_ptr<event> create_event(event_type_t event_type)
+	return sizeof(event_type) + sizeof(event_no) + event_data_len;
+}
+
+std::uint32_t event::calculate_total_len_with_crc32(
+	const std::vector<std::string>& player_names/* = {}*/) const
+{
+	return sizeof(len) + calculate_len(player_names) + sizeof(crc32);
+}
+
+void event::serialize(stream_writer& writer,
+	const std::vector<std::string>& player_names/* = {}*/) const
+{
+	// Whole event is bounds-checked once, every event type has fixed layout
+	// except for NEW_GAME player names
+	const std::uint32_t event_len = calculate_len(player_names);
+	const size_t crc_offset = sizeof(len) + event_len;
+	std::uint8_t* out = writer.claim(crc_offset + sizeof(crc32));
+	if (out == nullptr)
+		return;
+
+	event header = *this;
+	header.len = event_len;
+	event_header_layout::encode(out, header);
+
+	std::uint8_t* data = out + event_header_layout::size;
+	switch (event_type)
 	{
-		switch (event_type)
+	case NEW_GAME:
+		new_game_layout::encode(data, new_game_data);
+		data += new_game_layout::size;
+		for (const auto& name : player_names)
 		{
-		case NEW_GAME: return std::make_shared<new_game>();
-		case PLAYER_ELIMINATED: return std::make_shared<player_eliminated>();
-		case PIXEL: return std::make_shared<pixel>();
-		case GAME_OVER: return std::make_shared<game_over>();
-		default: return nullptr;
+			memcpy(data, name.c_str(), name.size() + sizeof('\0'));
+			data += name.size() + sizeof('\0');
 		}
+		break;
+	case PIXEL: pixel_layout::encode(data, pixel_data); break;
+	case PLAYER_ELIMINATED: player_eliminated_layout::encode(data, player_eliminated_data); break;
+	case GAME_OVER: game_over_layout::encode(data, game_over_data); break;
+	default: break;
 	}
-}
 
-event::event() : event(UNKNOWN) {}
-event::event(event_type_t type) : event_type(type) {}
+	schema::store_be(out + crc_offset, xcrc32(out, crc_offset, 0));
+}
 
-std::uint32_t event::calculate_len() const
+size_t event::serialize(std::uint8_t* buf, size_t len,
+	const std::vector<std::string>& player_names/* = {}*/) const
 {
-	return sizeof(event_type) + sizeof(event_no); // + sizeof(event_data) in subclasses
+	stream_writer writer(buf, len);
+	serialize(writer, player_names);
+	return writer.ok() ? writer.size() : 0;
 }
 
-std::uint32_t event::calculate_total_len_with_crc32() const
+std::vector<std::uint8_t> event::as_stream(const std::vector<std::string>& player_names/* = {}*/) const
 {
-	return sizeof(len) + calculate_len() + sizeof(crc32);
+	std::vector<std::uint8_t> stream(calculate_total_len_with_crc32(player_names));
+	serialize(stream.data(), stream.size(), player_names);
+	return stream;
 }
 
-std::vector<std::uint8_t> event::as_stream() const
+namespace
 {
-	std::vector<std::uint8_t> stream;
+	// Serialized PIXEL event is the same up to event_no, player_number, x and
+	// y, and this CRC is linear (init 0, no final xor). So its CRC is the CRC
+	// of the constant bytes xored with independent contributions of every
+	// variable byte, which are looked up per byte position instead of
+	// running the CRC byte after byte.
+	constexpr size_t PIXEL_CRC_LEN = PIXEL_EVENT_LEN - sizeof(event::crc32);
+	constexpr size_t PIXEL_VARIABLE_OFFSET = sizeof(event::len) + sizeof(event::event_type);
+	constexpr size_t PIXEL_VARIABLE_LEN = PIXEL_CRC_LEN - PIXEL_VARIABLE_OFFSET;
+
+	struct pixel_crc_tables
+	{
+		std::uint8_t header[PIXEL_VARIABLE_OFFSET]; // constant len and event_type
+		std::uint32_t base; // CRC with all variable bytes set to 0
+		std::uint32_t table[PIXEL_VARIABLE_LEN][256];
+	};
 
-	append_bytes(stream, as_bytes(htonl(calculate_len())));
-	append_bytes(stream, as_bytes(event_type));
-	append_bytes(stream, as_bytes(htonl(event_no)));
+	// Built on first use, clients never need them
+	const pixel_crc_tables& pixel_crc()
+	{
+		static const auto tables = []
+		{
+			pixel_crc_tables tables;
+
+			std::uint8_t record[PIXEL_EVENT_LEN];
+			const size_t len = event(pixel {}).serialize(record, sizeof(record));
+			(void) len;
+			memcpy(tables.header, record, sizeof(tables.header));
+			memset(record + PIXEL_VARIABLE_OFFSET, 0, PIXEL_VARIABLE_LEN);
+			tables.base = xcrc32(record, PIXEL_CRC_LEN, 0);
+
+			std::uint8_t variable[PIXEL_CRC_LEN] = { 0 };
+			for (size_t i = 0; i < PIXEL_VARIABLE_LEN; ++i)
+			{
+				for (int b = 0; b < 256; ++b)
+				{
+					variable[PIXEL_VARIABLE_OFFSET + i] = static_cast<std::uint8_t>(b);
+					tables.table[i][b] = xcrc32(variable, PIXEL_CRC_LEN, 0);
+				}
+				variable[PIXEL_VARIABLE_OFFSET + i] = 0;
+			}
+			return tables;
+		}();
+		return tables;
+	}
 
-	const auto& aux_data = aux_as_stream();
-	stream.insert(stream.end(), aux_data.begin(), aux_data.end());
+	// Field values of PIXEL events in the order they're serialized in
+	constexpr size_t PIXEL_BATCH = 8;
+	struct pixel_batch
+	{
+		std::uint32_t event_no[PIXEL_BATCH];
+		std::uint32_t player_number[PIXEL_BATCH];
+		std::uint32_t x[PIXEL_BATCH];
+		std::uint32_t y[PIXEL_BATCH];
+		std::uint32_t crc32[PIXEL_BATCH];
+	};
+
+	std::uint32_t pixel_event_crc(const pixel_crc_tables& crc, std::uint32_t event_no,
+		std::uint8_t player_number, std::uint32_t x, std::uint32_t y)
+	{
+		const auto& t = crc.table;
+		return crc.base
+			^ t[0][event_no >> 24] ^ t[1][(event_no >> 16) & 255]
+			^ t[2][(event_no >> 8) & 255] ^ t[3][event_no & 255]
+			^ t[4][player_number]
+			^ t[5][x >> 24] ^ t[6][(x >> 16) & 255] ^ t[7][(x >> 8) & 255] ^ t[8][x & 255]
+			^ t[9][y >> 24] ^ t[10][(y >> 16) & 255] ^ t[11][(y >> 8) & 255] ^ t[12][y & 255];
+	}
+
+	void write_pixel_event(const pixel_crc_tables& crc, std::uint8_t* out,
+		std::uint32_t event_no, std::uint8_t player_number, std::uint32_t x,
+		std::uint32_t y, std::uint32_t crc32)
+	{
+		memcpy(out, crc.header, sizeof(crc.header));
+		out += sizeof(crc.header);
+		schema::store_be(out, event_no);
+		pixel_layout::encode(out + sizeof(event_no), pixel { player_number, x, y });
+		schema::store_be(out + PIXEL_VARIABLE_LEN, crc32);
+	}
 
-	auto crc =	xcrc32(stream.data(), stream.size(), 0);
-	append_bytes(stream, as_bytes(htonl(crc)));
+	// Fields in a batch are already byte swapped, so they're just copied
+	void write_swapped_pixel_event(const pixel_crc_tables& crc, std::uint8_t* out,
+		const pixel_batch& batch, size_t i)
+	{
+		memcpy(out, crc.header, sizeof(crc.header));
+		out += sizeof(crc.header);
+		memcpy(out, &batch.event_no[i], sizeof(std::uint32_t));
+		out[sizeof(std::uint32_t)] = static_cast<std::uint8_t>(batch.player_number[i]);
+		memcpy(out + 5, &batch.x[i], sizeof(std::uint32_t));
+		memcpy(out + 9, &batch.y[i], sizeof(std::uint32_t));
+		memcpy(out + 13, &batch.crc32[i], sizeof(std::uint32_t));
+	}
 
-	stream.shrink_to_fit();
-	return stream;
 }
 
-std::vector<std::uint8_t> event::aux_as_stream() const
+void serialize_pixel_events_generic(const event* events, size_t count, std::uint8_t* out)
 {
-	return {};
+	const auto& crc = pixel_crc();
+	for (size_t i = 0; i < count; ++i, out += PIXEL_EVENT_LEN)
+	{
+		const event& ev = events[i];
+		const pixel& data = ev.pixel_data;
+		write_pixel_event(crc, out, ev.event_no, data.player_number, data.x, data.y,
+			pixel_event_crc(crc, ev.event_no, data.player_number, data.x, data.y));
+	}
 }
 
-/* static */
-std::shared_ptr<event> event::parse(const char* buf, size_t buf_len, bool require_exact_size/* = false*/)
+namespace
 {
-	const std::uint8_t* stream = reinterpret_cast<const std::uint8_t*>(buf);
-	const std::uint8_t* pointer = stream;
+#ifdef PROTOCOL_X86_DISPATCH
+	// Looks up CRC contributions of byte at shift of every lane
+	__attribute__((target("avx2")))
+	__m256i gather_crc(const pixel_crc_tables& crc, size_t position, __m256i values, int shift)
+	{
+		const __m256i bytes = _mm256_and_si256(_mm256_srli_epi32(values, shift),
+			_mm256_set1_epi32(255));
+		return _mm256_i32gather_epi32(reinterpret_cast<const int*>(crc.table[position]), bytes, 4);
+	}
 
-	std::uint32_t len;
-	if (!consume_bytes(stream, buf_len, pointer, len))
-		return nullptr;
+	__attribute__((target("avx2")))
+	__m256i gather_crc_u32(const pixel_crc_tables& crc, size_t position, __m256i values)
+	{
+		return _mm256_xor_si256(
+			_mm256_xor_si256(gather_crc(crc, position, values, 24), gather_crc(crc, position + 1, values, 16)),
+			_mm256_xor_si256(gather_crc(crc, position + 2, values, 8), gather_crc(crc, position + 3, values, 0)));
+	}
 
-	std::uint8_t event_type;
-	if (!consume_bytes(stream, buf_len, pointer, event_type))
-		return nullptr;
+	// Byte swaps and calculates CRCs of PIXEL_BATCH events at once
+	__attribute__((target("avx2")))
+	void serialize_pixel_events_avx2(const event* events, size_t count, std::uint8_t* out)
+	{
+		const auto& crc = pixel_crc();
+		const __m256i bswap = _mm256_setr_epi8(
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+		alignas(32) pixel_batch batch;
+		size_t i = 0;
+		for (; i + PIXEL_BATCH <= count; i += PIXEL_BATCH)
+		{
+			for (size_t lane = 0; lane < PIXEL_BATCH; ++lane)
+			{
+				const event& ev = events[i + lane];
+				batch.event_no[lane] = ev.event_no;
+				batch.player_number[lane] = ev.pixel_data.player_number;
+				batch.x[lane] = ev.pixel_data.x;
+				batch.y[lane] = ev.pixel_data.y;
+			}
+
+			const __m256i event_no = _mm256_load_si256(reinterpret_cast<const __m256i*>(batch.event_no));
+			const __m256i player_number = _mm256_load_si256(reinterpret_cast<const __m256i*>(batch.player_number));
+			const __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(batch.x));
+			const __m256i y = _mm256_load_si256(reinterpret_cast<const __m256i*>(batch.y));
+
+			__m256i crc32 = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(crc.base)),
+				gather_crc_u32(crc, 0, event_no));
+			crc32 = _mm256_xor_si256(crc32, gather_crc(crc, 4, player_number, 0));
+			crc32 = _mm256_xor_si256(crc32, gather_crc_u32(crc, 5, x));
+			crc32 = _mm256_xor_si256(crc32, gather_crc_u32(crc, 9, y));
+
+			_mm256_store_si256(reinterpret_cast<__m256i*>(batch.event_no), _mm256_shuffle_epi8(event_no, bswap));
+			_mm256_store_si256(reinterpret_cast<__m256i*>(batch.x), _mm256_shuffle_epi8(x, bswap));
+			_mm256_store_si256(reinterpret_cast<__m256i*>(batch.y), _mm256_shuffle_epi8(y, bswap));
+			_mm256_store_si256(reinterpret_cast<__m256i*>(batch.crc32), _mm256_shuffle_epi8(crc32, bswap));
+
+			for (size_t lane = 0; lane < PIXEL_BATCH; ++lane, out += PIXEL_EVENT_LEN)
+				write_swapped_pixel_event(crc, out, batch, lane);
+		}
+		serialize_pixel_events_generic(events + i, count - i, out);
+	}
+#endif
 
-	std::uint32_t event_no;
-	if (!consume_bytes(stream, buf_len, pointer, event_no))
-		return nullptr;
+	using serialize_pixel_events_fn = void (*)(const event*, size_t, std::uint8_t*);
 
-	auto event = create_event(static_cast<event_type_t>(event_type));
-	// Parsed event type is invalid or couldn't create event
-	if (event == nullptr)
-		return nullptr;
-	
-	event->len = len;
-	event->event_no = event_no;
+	serialize_pixel_events_fn select_serialize_pixel_events()
+	{
+#ifdef PROTOCOL_X86_DISPATCH
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return serialize_pixel_events_avx2;
+#endif
+		return serialize_pixel_events_generic;
+	}
 
-	pointer = event->parse_event_data(pointer, len - sizeof(event::event_no) - sizeof(event::event_type));
-	// Could not succesfully parse event_data depending on event type
-	if (pointer == nullptr)
-		return nullptr;
+	// Selected on first use, so it works during static initialization as well
+	serialize_pixel_events_fn serialize_pixel_events_impl()
+	{
+		static const serialize_pixel_events_fn impl = select_serialize_pixel_events();
+		return impl;
+	}
+}
 
-	if (!consume_bytes(stream, buf_len, pointer, event->crc32))
-		return nullptr;
+void serialize_pixel_events(const event* events, size_t count, std::uint8_t* out)
+{
+	serialize_pixel_events_impl()(events, count, out);
+}
 
-	// Reported message length and parsed len do not match
-	//if (require_exact_size && len != (pointer - stream) - sizeof(event::crc32) - sizeof(event::len))
-	//	return nullptr;
+/* static */
+size_t event::parse(const char* buf, size_t buf_len, event& out,
+	std::vector<std::string>& player_names)
+{
+	event_view view;
+	const size_t parsed_len = event_view::parse(
+		reinterpret_cast<const std::uint8_t*>(buf), buf_len, view);
+	if (parsed_len == 0)
+		return 0;
 
-	// CRC checksum mismatch
-	auto crc = xcrc32(stream, (pointer - sizeof(event::crc32)) - stream, 0);
-	if (crc != event->crc32) {
-		fprintf(stderr, "CRC checksum mismatch\n");
-		return nullptr;
-	}
+	out = view.to_event();
+	if (out.event_type == NEW_GAME)
+		player_names = view.as_new_game().player_names().to_vector();
 
-	// Data was exact, event could be created and crc matches - we're good to go
-	return event;
+	return parsed_len;
 }
 
-const uint8_t* event::parse_event_data(const uint8_t* buf, size_t len)
+size_t client_message::serialize(std::uint8_t* buf, size_t len) const
 {
-	// Bare event doesn't contain any extra info
-	return buf;
+	stream_writer writer(buf, len);
+
+	writer.write_fields<client_message_layout>(*this);
+	writer.write_bytes(player_name, strnlen(player_name, sizeof(player_name)));
+
+	return writer.ok() ? writer.size() : 0;
 }
 
-new_game::new_game() : event(NEW_GAME) {}
-new_game::new_game(std::uint32_t width, std::uint32_t height,
-	const std::vector<std::string>& names)
-: event(NEW_GAME)
-, maxx(width)
-, maxy(height)
-, player_names(names)
+std::vector<std::uint8_t> client_message::as_stream() const
 {
+	std::vector<std::uint8_t> stream(MAX_LEN);
+	stream.resize(serialize(stream.data(), stream.size()));
+	return stream;
 }
 
-std::uint32_t new_game::calculate_len() const
+size_t server_message::serialize(std::uint8_t* buf, size_t len) const
 {
-	auto event_data_len = sizeof(maxx) + sizeof(maxy);
+	stream_writer writer(buf, len);
 
-	for (const auto& name : player_names)
-		event_data_len += name.length() + sizeof('\0');
+	writer.write(game_id);
+	for (const auto& event : events)
+		event.serialize(writer, player_names);
 
-	return event::calculate_len() + event_data_len;
+	return writer.ok() ? writer.size() : 0;
 }
 
-std::vector<std::uint8_t> new_game::aux_as_stream() const
+std::vector<std::uint8_t> server_message::as_stream() const
 {
-	std::vector<std::uint8_t> stream;
+	size_t len = sizeof(game_id);
+	for (const auto& event : events)
+		len += event.calculate_total_len_with_crc32(player_names);
 
-	append_bytes(stream, as_bytes(htonl(maxx)));
-	append_bytes(stream, as_bytes(htonl(maxy)));
-	for (const auto& str : player_names)
+	std::vector<std::uint8_t> stream(len);
+	serialize(stream.data(), stream.size());
+	return stream;
+}
+
+/* static */
+std::pair<server_message, bool> server_message::from(const char* stream, size_t len)
+{
+	server_message msg;
+
+	server_message_view view;
+	const bool valid = server_message_view::parse(stream, len, view);
+	msg.game_id = view.game_id;
+	msg.events.reserve(view.event_count);
+	for (const auto& event : view)
 	{
-		append_string(stream, str.c_str());
-		stream.push_back('\0');
+		msg.events.push_back(event.to_event());
+		if (event.event_type() == NEW_GAME)
+			msg.player_names = event.as_new_game().player_names().to_vector();
 	}
 
-	stream.shrink_to_fit();
-	return stream;
+	return { msg, valid };
 }
 
-const uint8_t* new_game::parse_event_data(const uint8_t* buf, size_t len)
+/* static */
+bool server_message_view::parse(const char* stream, size_t len, server_message_view& out)
 {
-	const uint8_t* pointer = buf;
-	if (!consume_bytes(buf, len, pointer, this->maxx)) return nullptr;
-	if (!consume_bytes(buf, len, pointer, this->maxy)) return nullptr;
+	const uint8_t* data = reinterpret_cast<const std::uint8_t*>(stream);
+	const uint8_t* pointer = data;
 
-	while (pointer < buf + len)
+	out.game_id = 0;
+	out.events_data = data;
+	out.events_len = 0;
+	out.event_count = 0;
+	if (len < sizeof(out.game_id))
+		return false;
+
+	out.game_id = load_be<std::uint32_t>(data);
+	pointer += sizeof(out.game_id);
+	out.events_data = pointer;
+	size_t message_len = sizeof(out.game_id);
+	while (message_len < MAX_EVENT_PACKET_DATA_SIZE)
 	{
-		const char* str = reinterpret_cast<const char*>(pointer);
-		int name_len = strlen(str);
-		// Invalid name length
-		if (name_len <= 0 || name_len > 64)
-			return nullptr;
-		const std::uint8_t* name_end = pointer + name_len;
-		// Name extends message length or isn't 0-separated
-		if (name_end >= buf + len || *name_end != '\0')
-			return nullptr;
-
-		this->player_names.push_back(std::string(str));
-		pointer += name_len + sizeof('\0');
+		event_view event;
+		const size_t event_len = event_view::parse(pointer, len - message_len, event);
+		// One of the events is probably malformed (partial message is acceptable if we have > 0 correct events)
+		if (event_len == 0)
+			return out.event_count > 0;
+
+		if (message_len + event_len > MAX_EVENT_PACKET_DATA_SIZE)
+			break;
+
+		pointer += event_len;
+
+		message_len += event_len;
+		out.events_len += event_len;
+		out.event_count++;
 	}
 
-	return pointer;
+	return true;
 }
 
-pixel::pixel() : event(PIXEL) {}
-pixel::pixel(std::uint8_t player, std::uint32_t px, std::uint32_t py)
-: event(PIXEL)
-, player_number(player)
-, x(px)
-, y(py)
+event_view server_message_view::iterator::operator*() const
 {
+	const size_t total_len = event::HEADER_LEN + event_data_len(m_pos) + sizeof(event::crc32);
+	return event_view { m_pos, total_len };
 }
 
-std::uint32_t pixel::calculate_len() const
+server_message_view::iterator& server_message_view::iterator::operator++()
 {
-	auto event_data_len = sizeof(player_number) + sizeof(x) + sizeof(y);
-	return event::calculate_len() + event_data_len;
+	m_pos += event::HEADER_LEN + event_data_len(m_pos) + sizeof(event::crc32);
+	return *this;
 }
 
-std::vector<std::uint8_t> pixel::aux_as_stream() const
+/* static */
+size_t event_view::parse(const std::uint8_t* buf, size_t buf_len, event_view& out)
 {
-	std::vector<std::uint8_t> stream;
+	const std::uint8_t* stream = buf;
+	if (buf_len < event_header_layout::size)
+		return 0;
 
-	append_bytes(stream, as_bytes(player_number));
-	append_bytes(stream, as_bytes(htonl(x)));
-	append_bytes(stream, as_bytes(htonl(y)));
+	event header;
+	event_header_layout::decode(stream, header);
+	const std::uint8_t* pointer = stream + event_header_layout::size;
 
-	stream.shrink_to_fit();
-	return stream;
+	const size_t remaining = buf_len - event_header_layout::size;
+	size_t data_len = 0;
+	switch (header.event_type)
+	{
+	case NEW_GAME:
+		// Names take up the rest of reported event length
+		data_len = std::min<size_t>(header.len - sizeof(header.event_no) - sizeof(header.event_type), remaining);
+		if (data_len < new_game_layout::size)
+			return 0;
+		if (!validate_player_names(pointer + new_game_layout::size, data_len - new_game_layout::size))
+			return 0;
+		break;
+	case PIXEL: data_len = pixel_layout::size; break;
+	case PLAYER_ELIMINATED: data_len = player_eliminated_layout::size; break;
+	case GAME_OVER: data_len = game_over_layout::size; break;
+	// Parsed event type is invalid
+	default: return 0;
+	}
+	// Not enough data for event_data depending on event type and crc32
+	if (data_len + sizeof(event::crc32) > remaining)
+		return 0;
+	pointer += data_len;
+
+	const std::uint32_t crc32 = load_be<std::uint32_t>(pointer);
+	pointer += sizeof(crc32);
+
+	// CRC checksum mismatch
+	auto crc = xcrc32(stream, (pointer - sizeof(crc32)) - stream, 0);
+	if (crc != crc32) {
+		fprintf(stderr, "CRC checksum mismatch\n");
+		return 0;
+	}
+
+	out = event_view { stream, static_cast<size_t>(pointer - stream) };
+	return out.total_len;
 }
 
-const uint8_t* pixel::parse_event_data(const uint8_t* buf, size_t len)
+std::uint32_t event_view::len() const
 {
-	const uint8_t* pointer = buf;
-	if (!consume_bytes(buf, len, pointer, this->player_number)) return nullptr;
-	if (!consume_bytes(buf, len, pointer, this->x)) return nullptr;
-	if (!consume_bytes(buf, len, pointer, this->y)) return nullptr;
-	
-	return pointer;
+	return event_header_layout::get<0>(data);
 }
 
-player_eliminated::player_eliminated() : event(PLAYER_ELIMINATED) {}
-player_eliminated::player_eliminated(std::uint8_t player)
-: event(PLAYER_ELIMINATED)
-, player_number(player)
+event_type_t event_view::event_type() const
 {
+	return event_header_layout::get<1>(data);
 }
 
-std::uint32_t player_eliminated::calculate_len() const
+std::uint32_t event_view::event_no() const
 {
-	auto event_data_len = sizeof(player_number);
-	return event::calculate_len() + event_data_len;
+	return event_header_layout::get<2>(data);
 }
 
-std::vector<std::uint8_t> player_eliminated::aux_as_stream() const
+std::uint32_t event_view::crc32() const
 {
-	std::vector<std::uint8_t> stream;
-	stream.push_back(player_number);
-	return stream;
+	return load_be<std::uint32_t>(data + total_len - sizeof(event::crc32));
 }
 
-const uint8_t* player_eliminated::parse_event_data(const uint8_t* buf, size_t len)
+new_game_view event_view::as_new_game() const
 {
-	const uint8_t* pointer = buf;
-	if (!consume_bytes(buf, len, pointer, this->player_number)) return nullptr;
-
-	return pointer;
+	return new_game_view { data + event_header_layout::size,
+		total_len - event_header_layout::size - sizeof(event::crc32) };
 }
 
-game_over::game_over() : event(GAME_OVER) {}
+pixel_view event_view::as_pixel() const
+{
+	return pixel_view { data + event_header_layout::size };
+}
 
-std::vector<std::uint8_t> game_over::aux_as_stream() const
+player_eliminated_view event_view::as_player_eliminated() const
 {
-	return {};
+	return player_eliminated_view { data + event_header_layout::size };
 }
 
-std::vector<std::uint8_t> client_message::as_stream() const
+event event_view::to_event() const
 {
-	std::vector<std::uint8_t> stream;
+	event result;
+	event_header_layout::decode(data, result);
 
-	append_bytes(stream, as_bytes(htonll(session_id)));
-	append_bytes(stream, as_bytes(turn_direction));
-	append_bytes(stream, as_bytes(htonl(next_expected_event)));
-	append_string(stream, player_name);
+	const std::uint8_t* event_data = data + event_header_layout::size;
+	switch (result.event_type)
+	{
+	case NEW_GAME: new_game_layout::decode(event_data, result.new_game_data); break;
+	case PIXEL: pixel_layout::decode(event_data, result.pixel_data); break;
+	case PLAYER_ELIMINATED: player_eliminated_layout::decode(event_data, result.player_eliminated_data); break;
+	case GAME_OVER: game_over_layout::decode(event_data, result.game_over_data); break;
+	default: break;
+	}
 
-	stream.shrink_to_fit();
-	return stream;
+	result.crc32 = crc32();
+	return result;
 }
 
-std::vector<std::uint8_t> server_message::as_stream() const
+std::uint32_t new_game_view::maxx() const
 {
-	std::vector<std::uint8_t> stream;
+	return new_game_layout::get<0>(data);
+}
 
-	append_bytes(stream, as_bytes(htonl(game_id)));
-	for (const auto& event : events)
-	{
-		auto event_stream = event->as_stream();
-		stream.insert(stream.end(), event_stream.begin(), event_stream.end());
-	}
+std::uint32_t new_game_view::maxy() const
+{
+	return new_game_layout::get<1>(data);
+}
 
-	stream.shrink_to_fit();
-	return stream;
+name_list_view new_game_view::player_names() const
+{
+	return name_list_view { reinterpret_cast<const char*>(data) + new_game_layout::size,
+		len - new_game_layout::size };
 }
 
-/* static */
-std::pair<server_message, bool> server_message::from(const char* stream, size_t len)
+name_view name_list_view::iterator::operator*() const
 {
-	server_message msg;
+	return name_view { m_pos, strlen(m_pos) };
+}
 
-	const uint8_t* data = reinterpret_cast<const std::uint8_t*>(stream);
-	const uint8_t* pointer = data;
-	if (!consume_bytes(data, len, pointer, msg.game_id))
-		return { msg, false };
+name_list_view::iterator& name_list_view::iterator::operator++()
+{
+	m_pos += strlen(m_pos) + sizeof('\0');
+	return *this;
+}
 
-	int message_len = sizeof(msg.game_id);
-	while (message_len < MAX_EVENT_PACKET_DATA_SIZE)
-	{
-		auto event = event::parse((const char*)pointer, len - message_len);
-		// One of the events is probably malformed (partial message is acceptable if we have > 0 correct events)
-		if (event == nullptr)
-			return { msg, msg.events.size() > 0 };
+size_t name_list_view::count() const
+{
+	return std::count(data, data + len, '\0');
+}
 
-		const auto event_len = event->calculate_total_len_with_crc32();
-		if (len + event_len > MAX_EVENT_PACKET_DATA_SIZE)
-			break;
+std::vector<std::string> name_list_view::to_vector() const
+{
+	std::vector<std::string> names;
+	names.reserve(count());
+	for (const auto& name : *this)
+		names.push_back(name.str());
+	return names;
+}
 
-		pointer += event_len;
+std::uint8_t pixel_view::player_number() const
+{
+	return pixel_layout::get<0>(data);
+}
 
-		message_len += event_len;
-		msg.events.push_back(event);
-	}
+std::uint32_t pixel_view::x() const
+{
+	return pixel_layout::get<1>(data);
+}
 
-	return { msg, true };
+std::uint32_t pixel_view::y() const
+{
+	return pixel_layout::get<2>(data);
+}
+
+std::uint8_t player_eliminated_view::player_number() const
+{
+	return player_eliminated_layout::get<0>(data);
 }
 
 /* static */
 std::pair<client_message, bool> client_message::from(const char* stream, size_t len)
 {
-	constexpr int MIN_MESSAGE_LEN = sizeof(client_message::session_id)
-		+ sizeof(client_message::turn_direction)
-		+ sizeof(client_message::next_expected_event) + sizeof('\0');
+	constexpr int MIN_MESSAGE_LEN = client_message_layout::size + sizeof('\0');
 
 	if (len <= MIN_MESSAGE_LEN)
 		return std::make_pair(client_message(), false);
@@ -379,10 +651,8 @@ std::pair<client_message, bool> client_message::from(const char* stream, size_t
 	client_message msg;
 
 	const uint8_t* data = reinterpret_cast<const std::uint8_t*>(stream);
-	const uint8_t* pointer = data;
-	consume_bytes(data, len, pointer, msg.session_id);
-	consume_bytes(data, len, pointer, msg.turn_direction);
-	consume_bytes(data, len, pointer, msg.next_expected_event);
+	client_message_layout::decode(data, msg);
+	const uint8_t* pointer = data + client_message_layout::size;
 
 	// Only { -1, 0, 1 } are valid turn_directions
 	if (std::abs(msg.turn_direction) > 1)
@@ -401,3 +671,50 @@ std::pair<client_message, bool> client_message::from(const char* stream, size_t
 
 	return std::make_pair(msg, true);
 }
+
+bool selective_ack::has(std::uint32_t event_no) const
+{
+	if (event_no <= next_expected_event || event_no - next_expected_event > bitmap_len * 8)
+		return false;
+
+	const std::uint32_t bit = event_no - next_expected_event - 1;
+	return (bitmap[bit / 8] & (0x80 >> (bit % 8))) != 0;
+}
+
+void selective_ack::set(std::uint32_t event_no)
+{
+	if (event_no <= next_expected_event || event_no - next_expected_event > MAX_EVENTS)
+		return;
+
+	const std::uint32_t bit = event_no - next_expected_event - 1;
+	bitmap[bit / 8] |= 0x80 >> (bit % 8);
+	bitmap_len = std::max<size_t>(bitmap_len, bit / 8 + 1);
+}
+
+size_t selective_ack::serialize(std::uint8_t* buf, size_t len) const
+{
+	stream_writer writer(buf, len);
+
+	writer.write_fields<selective_ack_layout>(*this);
+	writer.write_bytes(bitmap, bitmap_len);
+
+	return writer.ok() && bitmap_len > 0 ? writer.size() : 0;
+}
+
+std::pair<selective_ack, bool> selective_ack::from(const char* stream, size_t len)
+{
+	if (len <= selective_ack_layout::size || len > selective_ack_layout::size + MAX_BITMAP_LEN)
+		return std::make_pair(selective_ack(), false);
+
+	selective_ack msg;
+
+	const uint8_t* data = reinterpret_cast<const std::uint8_t*>(stream);
+	selective_ack_layout::decode(data, msg);
+	if (msg.marker != MARKER)
+		return std::make_pair(selective_ack(), false);
+
+	msg.bitmap_len = len - selective_ack_layout::size;
+	memcpy(msg.bitmap, data + selective_ack_layout::size, msg.bitmap_len);
+
+	return std::make_pair(msg, true);
+}
@@ -1,39 +1,138 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
+#include <type_traits>
 #include <vector>
 #include <string>
 #include <memory>
 #include <utility>
 
+#include "protocol_schema.h"
+
 constexpr int MAX_EVENT_PACKET_DATA_SIZE = 512;
 
-struct event;
+// Bounds-checked cursor writing big-endian data into caller-provided buffer.
+// Once a write doesn't fit, the writer is marked as failed and ignores any
+// further writes.
+class stream_writer
+{
+public:
+	stream_writer(std::uint8_t* buf, size_t len) : m_begin(buf), m_pos(buf), m_end(buf + len) {}
+
+	template<typename T>
+	void write(T value)
+	{
+		static_assert(std::is_integral<T>::value, "Only integers can be written");
+		if (std::uint8_t* out = claim(sizeof(T)))
+			schema::store_be(out, value);
+	}
+
+	// Writes all fields of the layout with a single bounds check
+	template<typename Layout, typename T>
+	void write_fields(const T& value)
+	{
+		if (std::uint8_t* out = claim(Layout::size))
+			Layout::encode(out, value);
+	}
+
+	void write_bytes(const void* data, size_t len)
+	{
+		if (std::uint8_t* out = claim(len))
+			memcpy(out, data, len);
+	}
+
+	// Reserves len bytes for the caller to fill in, returns nullptr if they
+	// don't fit
+	std::uint8_t* claim(size_t len)
+	{
+		if (!reserve(len))
+			return nullptr;
+		std::uint8_t* out = m_pos;
+		m_pos += len;
+		return out;
+	}
+
+	std::uint8_t* position() const { return m_pos; }
+	size_t size() const { return m_pos - m_begin; }
+	bool ok() const { return m_begin != nullptr; }
+
+private:
+	bool reserve(size_t len)
+	{
+		if (m_begin == nullptr || len > static_cast<size_t>(m_end - m_pos))
+		{
+			m_begin = m_pos = m_end = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	std::uint8_t* m_begin;
+	std::uint8_t* m_pos;
+	std::uint8_t* m_end;
+};
 
 struct client_message
 {
-	std::uint64_t session_id;
-	std::int8_t turn_direction;
-	std::uint32_t next_expected_event;
+	std::uint64_t session_id = 0;
+	std::int8_t turn_direction = 0;
+	std::uint32_t next_expected_event = 0;
 	char player_name[64] = { 0 };
+
+	constexpr static size_t MAX_LEN = sizeof(session_id) + sizeof(turn_direction)
+		+ sizeof(next_expected_event) + sizeof(player_name);
+
+	// Returns number of bytes written or 0 if the message doesn't fit
+	size_t serialize(std::uint8_t* buf, size_t len) const;
 	std::vector<std::uint8_t> as_stream() const;
 
 	static std::pair<client_message, bool> from(const char* stream, size_t len);
 };
 
-struct server_message
+// Fixed part of client_message, followed by player_name (without '\0')
+using client_message_layout = schema::layout<
+	SCHEMA_FIELD(client_message, session_id),
+	SCHEMA_FIELD(client_message, turn_direction),
+	SCHEMA_FIELD(client_message, next_expected_event)>;
+
+// Optional heartbeat extension: clients holding events received past their
+// next_expected_event report them in this separate datagram, sent along with
+// the heartbeat. It carries MARKER in place of turn_direction, so servers not
+// supporting the extension simply reject it as an invalid heartbeat.
+struct selective_ack
 {
-	std::uint32_t game_id;
-	std::vector<std::shared_ptr<event>> events;
+	constexpr static std::int8_t MARKER = -128;
+	constexpr static size_t MAX_BITMAP_LEN = 32; // covers 256 events
 
-	constexpr static int HEADER_LEN = sizeof(server_message::game_id);
-	constexpr static int MAX_EVENTS_LEN = MAX_EVENT_PACKET_DATA_SIZE
-		- sizeof(server_message::game_id);
+	std::uint64_t session_id;
+	std::int8_t marker = MARKER;
+	std::uint32_t next_expected_event;
+	std::uint32_t game_id; // of the received events
+	// Bit i (most significant first) is set if event next_expected_event + 1 + i
+	// was received
+	std::uint8_t bitmap[MAX_BITMAP_LEN] = { 0 };
+	size_t bitmap_len = 0; // in bytes, as sent
 
-	std::vector<std::uint8_t> as_stream() const;
-	static std::pair<server_message, bool> from(const char* stream, size_t len);
+	// Furthest event past next_expected_event the bitmap can cover
+	constexpr static size_t MAX_EVENTS = MAX_BITMAP_LEN * 8;
+
+	bool has(std::uint32_t event_no) const;
+	// Only events in (next_expected_event, next_expected_event + MAX_EVENTS]
+	// can be set
+	void set(std::uint32_t event_no);
+
+	// Returns number of bytes written or 0 if the message doesn't fit
+	size_t serialize(std::uint8_t* buf, size_t len) const;
+	static std::pair<selective_ack, bool> from(const char* stream, size_t len);
 };
 
+// Fixed part of selective_ack, followed by 1 to MAX_BITMAP_LEN bitmap bytes
+using selective_ack_layout = schema::layout<
+	SCHEMA_FIELD(selective_ack, session_id),
+	SCHEMA_FIELD(selective_ack, marker),
+	SCHEMA_FIELD(selective_ack, next_expected_event),
+	SCHEMA_FIELD(selective_ack, game_id)>;
 
 enum event_type_t : std::uint8_t
 {
@@ -44,76 +143,237 @@ enum event_type_t : std::uint8_t
 	UNKNOWN = 0xFF,
 };
 
+// Event data of every event type. These are plain values, (de)serialized
+// without the common event header and CRC according to their layouts.
+struct new_game
+{
+    std::uint32_t maxx;
+    std::uint32_t maxy;
+    // Player names are variable-length, so they're kept outside of the event
+    // (each name is up to 64 chars and ends with '\0' on the wire)
+};
+
+// Fixed part of NEW_GAME, followed by player names
+using new_game_layout = schema::layout<
+	SCHEMA_FIELD(new_game, maxx),
+	SCHEMA_FIELD(new_game, maxy)>;
+
+struct pixel
+{
+    std::uint8_t player_number;
+    std::uint32_t x;
+    std::uint32_t y;
+};
+
+using pixel_layout = schema::layout<
+	SCHEMA_FIELD(pixel, player_number),
+	SCHEMA_FIELD(pixel, x),
+	SCHEMA_FIELD(pixel, y)>;
+
+struct player_eliminated
+{
+    std::uint8_t player_number;
+};
+
+using player_eliminated_layout = schema::layout<
+	SCHEMA_FIELD(player_eliminated, player_number)>;
+
+struct game_over
+{
+};
+
+using game_over_layout = schema::layout<>;
+
+// Compact, trivially copyable event: common header and tagged union of the
+// event data, so event logs are contiguous and need no allocations
 struct event
 {
-	std::uint32_t len; // sizeof(event_* members data)
-	const event_type_t event_type;
-	std::uint32_t event_no; // consecutive values for each game session,
-	std::uint32_t crc32; // crc checksum from len to, including, event_type
+	std::uint32_t len = 0; // sizeof(event_* members data)
+	event_type_t event_type;
+	std::uint32_t event_no = 0; // consecutive values for each game session,
+	std::uint32_t crc32 = 0; // crc checksum from len to, including, event_type
+	union
+	{
+		struct new_game new_game_data;
+		struct pixel pixel_data;
+		struct player_eliminated player_eliminated_data;
+		struct game_over game_over_data;
+	};
 
 	constexpr static int HEADER_LEN = sizeof(event::len) +
 		sizeof(event::event_type) + sizeof(event::event_no);
 
 	event();
-    event(event_type_t type);
-	virtual ~event() = default;
+	event(const struct new_game& data);
+	event(const struct pixel& data);
+	event(const struct player_eliminated& data);
+	event(const struct game_over& data);
 
-	virtual std::uint32_t calculate_len() const;
-	std::uint32_t calculate_total_len_with_crc32() const;
-	virtual std::vector<std::uint8_t> as_stream() const;
-	// Overridable for extending subclasses
-	virtual std::vector<std::uint8_t> aux_as_stream() const;
+	// player_names are only used for NEW_GAME
+	std::uint32_t calculate_len(const std::vector<std::string>& player_names = {}) const;
+	std::uint32_t calculate_total_len_with_crc32(
+		const std::vector<std::string>& player_names = {}) const;
+	void serialize(stream_writer& writer, const std::vector<std::string>& player_names = {}) const;
+	// Returns number of bytes written or 0 if the event doesn't fit
+	size_t serialize(std::uint8_t* buf, size_t len,
+		const std::vector<std::string>& player_names = {}) const;
+	std::vector<std::uint8_t> as_stream(const std::vector<std::string>& player_names = {}) const;
 
-	static std::shared_ptr<event> parse(const char* buf, size_t len, bool require_exact_size = false);
-	virtual const uint8_t* parse_event_data(const uint8_t* buf, size_t len);
+	// Parses single event from the buffer, on success returns number of bytes
+	// it took and fills player_names if it's NEW_GAME, otherwise returns 0
+	static size_t parse(const char* buf, size_t len, event& out,
+		std::vector<std::string>& player_names);
 };
 
-struct new_game : public event
+// Common event header, followed by event data and crc32
+using event_header_layout = schema::layout<
+	SCHEMA_FIELD(event, len),
+	SCHEMA_FIELD(event, event_type),
+	SCHEMA_FIELD(event, event_no)>;
+
+// Serialized length of a PIXEL event, including len and crc32
+constexpr size_t PIXEL_EVENT_LEN = event_header_layout::size + pixel_layout::size
+	+ sizeof(event::crc32);
+
+// Serializes a run of PIXEL events exactly like event::serialize would, but
+// byte swaps fields and calculates CRCs of several events at once. Every
+// event has to be PIXEL and out needs room for count * PIXEL_EVENT_LEN bytes.
+void serialize_pixel_events(const event* events, size_t count, std::uint8_t* out);
+// Portable version of serialize_pixel_events, which is used when the CPU
+// doesn't support the SIMD one (exposed so both can be tested)
+void serialize_pixel_events_generic(const event* events, size_t count, std::uint8_t* out);
+
+struct server_message
 {
-    std::uint32_t maxx;
-    std::uint32_t maxy;
-    std::vector<std::string> player_names; // each name is up to 64 chars and
-    // ends with '\0'
-	new_game();
-	new_game(std::uint32_t width, std::uint32_t height,
-		const std::vector<std::string>& names);
-	virtual ~new_game() = default;
-	virtual std::uint32_t calculate_len() const override;
-	virtual std::vector<std::uint8_t> aux_as_stream() const override;
-	virtual const uint8_t* parse_event_data(const uint8_t* buf, size_t len) override;
+	std::uint32_t game_id;
+	std::vector<event> events;
+	// Player names of the NEW_GAME event contained in this message (if any)
+	std::vector<std::string> player_names;
+
+	constexpr static int HEADER_LEN = sizeof(server_message::game_id);
+	constexpr static int MAX_EVENTS_LEN = MAX_EVENT_PACKET_DATA_SIZE
+		- sizeof(server_message::game_id);
+
+	// Returns number of bytes written or 0 if the message doesn't fit
+	size_t serialize(std::uint8_t* buf, size_t len) const;
+	std::vector<std::uint8_t> as_stream() const;
+	static std::pair<server_message, bool> from(const char* stream, size_t len);
 };
 
-constexpr int MAX_PLAYER_NAMES_LEN = MAX_EVENT_PACKET_DATA_SIZE -
-(sizeof(new_game) - sizeof(new_game::player_names))
-- server_message::HEADER_LEN; // account for server_message header which will contain new_game event
 
-struct pixel : public event
+// Non-owning views over serialized events, validated in place. They point
+// directly into the parsed buffer, so they're only valid as long as it is.
+
+// Name that is part of a NEW_GAME player name list (not '\0'-terminated view)
+struct name_view
 {
-    std::uint8_t player_number;
-    std::uint32_t x;
-    std::uint32_t y;
-	pixel();
-	pixel(std::uint8_t player, std::uint32_t px, std::uint32_t py);
-	virtual ~pixel() = default;
-	virtual std::uint32_t calculate_len() const override;
-	virtual std::vector<std::uint8_t> aux_as_stream() const override;
-	virtual const uint8_t* parse_event_data(const uint8_t* buf, size_t len) override;
+	const char* data;
+	size_t size;
+
+	std::string str() const { return std::string(data, size); }
 };
 
-struct player_eliminated : public event
+// Sequence of consecutive '\0'-terminated player names
+struct name_list_view
 {
-    std::uint8_t player_number;
-	player_eliminated();
-	player_eliminated(std::uint8_t player);
-	virtual ~player_eliminated() = default;
-	virtual std::uint32_t calculate_len() const override;
-	virtual std::vector<std::uint8_t> aux_as_stream() const override;
-	virtual const uint8_t* parse_event_data(const uint8_t* buf, size_t len) override;
+	const char* data;
+	size_t len; // in bytes, including every '\0'
+
+	class iterator
+	{
+	public:
+		explicit iterator(const char* pos) : m_pos(pos) {}
+		name_view operator*() const;
+		iterator& operator++();
+		bool operator==(const iterator& other) const { return m_pos == other.m_pos; }
+		bool operator!=(const iterator& other) const { return m_pos != other.m_pos; }
+	private:
+		const char* m_pos;
+	};
+
+	iterator begin() const { return iterator(data); }
+	iterator end() const { return iterator(data + len); }
+	size_t count() const;
+	std::vector<std::string> to_vector() const;
 };
 
-struct game_over : public event
+struct new_game_view
 {
-	game_over();
-	virtual ~game_over() = default;
-	virtual std::vector<std::uint8_t> aux_as_stream() const override;
+	const std::uint8_t* data; // event data, right after event header
+	size_t len;
+
+	std::uint32_t maxx() const;
+	std::uint32_t maxy() const;
+	name_list_view player_names() const;
 };
+
+struct pixel_view
+{
+	const std::uint8_t* data;
+
+	std::uint8_t player_number() const;
+	std::uint32_t x() const;
+	std::uint32_t y() const;
+};
+
+struct player_eliminated_view
+{
+	const std::uint8_t* data;
+
+	std::uint8_t player_number() const;
+};
+
+struct event_view
+{
+	const std::uint8_t* data; // start of the event, i.e. its len field
+	size_t total_len; // including len and crc32
+
+	std::uint32_t len() const;
+	event_type_t event_type() const;
+	std::uint32_t event_no() const;
+	std::uint32_t crc32() const;
+
+	// Only valid to call for matching event_type()
+	new_game_view as_new_game() const;
+	pixel_view as_pixel() const;
+	player_eliminated_view as_player_eliminated() const;
+
+	// Copies the view into owning event (without NEW_GAME player names)
+	event to_event() const;
+
+	// Validates single event at the start of the buffer, on success returns
+	// number of bytes it took and sets out, otherwise returns 0
+	static size_t parse(const std::uint8_t* buf, size_t len, event_view& out);
+};
+
+// Validated server datagram; iterating it doesn't allocate or re-check events
+struct server_message_view
+{
+	std::uint32_t game_id;
+	const std::uint8_t* events_data;
+	size_t events_len; // only covers events that were succesfully validated
+	size_t event_count;
+
+	class iterator
+	{
+	public:
+		explicit iterator(const std::uint8_t* pos) : m_pos(pos) {}
+		event_view operator*() const;
+		iterator& operator++();
+		bool operator==(const iterator& other) const { return m_pos == other.m_pos; }
+		bool operator!=(const iterator& other) const { return m_pos != other.m_pos; }
+	private:
+		const std::uint8_t* m_pos;
+	};
+
+	iterator begin() const { return iterator(events_data); }
+	iterator end() const { return iterator(events_data + events_len); }
+
+	// Accepts exactly the same datagrams as server_message::from
+	static bool parse(const char* stream, size_t len, server_message_view& out);
+};
+
+constexpr int MAX_PLAYER_NAMES_LEN = MAX_EVENT_PACKET_DATA_SIZE
+	- server_message::HEADER_LEN // server_message header which will contain new_game event
+	- event::HEADER_LEN - sizeof(event::crc32)
+	- new_game_layout::size;
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+
+// Declarative wire layout of fixed-size protocol structures. A layout is the
+// list of struct fields, encoded big-endian one right after another, and its
+// length, offsets, encoder and decoder are all generated at compile time.
+// Callers check the whole length once, so (de)coding itself is straight-line
+// code without per-field bounds checks.
+namespace schema
+{
+	namespace detail
+	{
+		template<typename T, bool = std::is_enum<T>::value>
+		struct wire_type { using type = typename std::make_unsigned<T>::type; };
+
+		template<typename T>
+		struct wire_type<T, true>
+		{
+			using type = typename std::make_unsigned<typename std::underlying_type<T>::type>::type;
+		};
+
+		// Spelled out per width, so compilers turn these into single
+		// byte-swapping loads and stores
+		template<size_t Size>
+		struct big_endian;
+
+		template<>
+		struct big_endian<1>
+		{
+			static std::uint8_t load(const std::uint8_t* in) { return in[0]; }
+			static void store(std::uint8_t* out, std::uint8_t value) { out[0] = value; }
+		};
+
+		template<>
+		struct big_endian<2>
+		{
+			static std::uint16_t load(const std::uint8_t* in)
+			{
+				return static_cast<std::uint16_t>(in[0] << 8 | in[1]);
+			}
+			static void store(std::uint8_t* out, std::uint16_t value)
+			{
+				out[0] = static_cast<std::uint8_t>(value >> 8);
+				out[1] = static_cast<std::uint8_t>(value);
+			}
+		};
+
+		template<>
+		struct big_endian<4>
+		{
+			static std::uint32_t load(const std::uint8_t* in)
+			{
+				return static_cast<std::uint32_t>(in[0]) << 24 | static_cast<std::uint32_t>(in[1]) << 16
+					| static_cast<std::uint32_t>(in[2]) << 8 | static_cast<std::uint32_t>(in[3]);
+			}
+			static void store(std::uint8_t* out, std::uint32_t value)
+			{
+				out[0] = static_cast<std::uint8_t>(value >> 24);
+				out[1] = static_cast<std::uint8_t>(value >> 16);
+				out[2] = static_cast<std::uint8_t>(value >> 8);
+				out[3] = static_cast<std::uint8_t>(value);
+			}
+		};
+
+		template<>
+		struct big_endian<8>
+		{
+			static std::uint64_t load(const std::uint8_t* in)
+			{
+				return static_cast<std::uint64_t>(big_endian<4>::load(in)) << 32 | big_endian<4>::load(in + 4);
+			}
+			static void store(std::uint8_t* out, std::uint64_t value)
+			{
+				big_endian<4>::store(out, static_cast<std::uint32_t>(value >> 32));
+				big_endian<4>::store(out + 4, static_cast<std::uint32_t>(value));
+			}
+		};
+	}
+
+	template<typename T>
+	inline void store_be(std::uint8_t* pointer, T value)
+	{
+		using U = typename detail::wire_type<T>::type;
+		detail::big_endian<sizeof(T)>::store(pointer, static_cast<U>(value));
+	}
+
+	template<typename T>
+	inline T load_be(const std::uint8_t* pointer)
+	{
+		return static_cast<T>(detail::big_endian<sizeof(T)>::load(pointer));
+	}
+
+	// Single integer (or enum) member of Struct
+	template<typename Struct, typename Member, Member Struct::*Pointer>
+	struct field
+	{
+		using type = Member;
+		constexpr static size_t size = sizeof(Member);
+
+		static void encode(std::uint8_t* out, const Struct& value) { store_be(out, value.*Pointer); }
+		static void decode(const std::uint8_t* in, Struct& value) { value.*Pointer = load_be<Member>(in); }
+	};
+
+	template<typename... Fields>
+	struct layout;
+
+	template<>
+	struct layout<>
+	{
+		constexpr static size_t size = 0;
+
+		template<size_t I>
+		constexpr static size_t offset() { return 0; }
+
+		template<typename Struct>
+		static void encode(std::uint8_t*, const Struct&) {}
+		template<typename Struct>
+		static void decode(const std::uint8_t*, Struct&) {}
+	};
+
+	template<typename Field, typename... Rest>
+	struct layout<Field, Rest...>
+	{
+		constexpr static size_t size = Field::size + layout<Rest...>::size;
+
+		template<size_t I>
+		using field_t = typename std::tuple_element<I, std::tuple<Field, Rest...>>::type;
+
+		// Offset of I-th field from the start of the layout
+		template<size_t I>
+		constexpr static size_t offset()
+		{
+			return I == 0 ? 0 : Field::size + layout<Rest...>::template offset<I - 1>();
+		}
+
+		// Reads I-th field directly from encoded data
+		template<size_t I>
+		static typename field_t<I>::type get(const std::uint8_t* in)
+		{
+			return load_be<typename field_t<I>::type>(in + offset<I>());
+		}
+
+		template<typename Struct>
+		static void encode(std::uint8_t* out, const Struct& value)
+		{
+			Field::encode(out, value);
+			layout<Rest...>::encode(out + Field::size, value);
+		}
+
+		template<typename Struct>
+		static void decode(const std::uint8_t* in, Struct& value)
+		{
+			Field::decode(in, value);
+			layout<Rest...>::decode(in + Field::size, value);
+		}
+	};
+}
+
+#define SCHEMA_FIELD(type, member) \
+	schema::field<type, decltype(type::member), &type::member>
@@ -0,0 +1,58 @@
+#include "reorder_buffer.h"
+
+constexpr size_t reorder_buffer::CAPACITY;
+
+void reorder_buffer::reset(std::uint32_t game_id)
+{
+	for (auto& slot : m_slots)
+		slot.held = false;
+	m_game_id = game_id;
+	m_size = 0;
+}
+
+bool reorder_buffer::insert(std::uint32_t game_id, std::uint32_t next_expected_event,
+	const event& event)
+{
+	if (game_id != m_game_id || event.event_no <= next_expected_event
+		|| event.event_no - next_expected_event > CAPACITY)
+		return false;
+
+	// Events ahead of next_expected_event never share a slot
+	slot& entry = m_slots[event.event_no % CAPACITY];
+	if (!entry.held)
+	{
+		entry.held = true;
+		m_size++;
+	}
+	entry.value = event;
+	return true;
+}
+
+bool reorder_buffer::take(std::uint32_t event_no, event& out)
+{
+	slot& entry = m_slots[event_no % CAPACITY];
+	if (!entry.held || entry.value.event_no != event_no)
+		return false;
+
+	out = entry.value;
+	entry.held = false;
+	m_size--;
+	return true;
+}
+
+size_t reorder_buffer::size() const
+{
+	return m_size;
+}
+
+void reorder_buffer::acknowledge(selective_ack& ack) const
+{
+	if (m_size == 0 || ack.game_id != m_game_id)
+		return;
+
+	for (const auto& slot : m_slots)
+	{
+		if (slot.held)
+			ack.set(slot.value.event_no);
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+#include "protocol.h"
+
+// Holds events of a single game received ahead of next_expected_event, so the
+// server doesn't have to send them again, and releases them once the events
+// before them arrive. It's bounded to events selective_ack can report, so
+// every held event has its own slot (indexed by event_no) and nothing is
+// allocated.
+class reorder_buffer
+{
+public:
+	constexpr static size_t CAPACITY = selective_ack::MAX_EVENTS;
+
+	// Drops all held events and starts holding events of the given game
+	void reset(std::uint32_t game_id);
+	// Holds the event if it's from the current game and at most CAPACITY events
+	// ahead of next_expected_event, returns whether it's held
+	bool insert(std::uint32_t game_id, std::uint32_t next_expected_event, const event& event);
+	// Removes held event with given event_no, returns false if it isn't held
+	bool take(std::uint32_t event_no, event& out);
+
+	size_t size() const;
+	// Marks all held events in the acknowledgement
+	void acknowledge(selective_ack& ack) const;
+
+private:
+	struct slot
+	{
+		event value;
+		bool held = false;
+	};
+
+	std::array<slot, CAPACITY> m_slots;
+	std::uint32_t m_game_id = 0;
+	size_t m_size = 0;
+};
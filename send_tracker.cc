@@ -0,0 +1,330 @@
+#include "send_tracker.h"
+
+#include <algorithm>
+
+constexpr std::chrono::milliseconds send_tracker::MIN_RETRANSMIT_TIMEOUT;
+constexpr std::chrono::milliseconds send_tracker::INITIAL_RETRANSMIT_TIMEOUT;
+constexpr std::chrono::milliseconds send_tracker::MAX_RETRANSMIT_TIMEOUT;
+constexpr unsigned send_tracker::MAX_STREAMING_BACKOFF;
+constexpr std::chrono::milliseconds send_tracker::PRODUCTION_PERIOD;
+constexpr std::uint32_t send_tracker::MIN_WINDOW;
+constexpr std::uint32_t send_tracker::INITIAL_WINDOW;
+constexpr std::uint32_t send_tracker::MAX_WINDOW;
+constexpr std::uint32_t send_tracker::REORDER_THRESHOLD;
+
+double send_tracker::counters::duplicate_ratio() const
+{
+	return events_sent == 0 ? 0.0 : static_cast<double>(events_resent) / events_sent;
+}
+
+void send_tracker::restart()
+{
+	m_acknowledged = m_next = m_max_sent = m_resend_end = m_resume = 0;
+	m_lost_end = m_recovered_end = m_recovery_point = 0;
+	m_in_flight.clear();
+	m_selectively_acknowledged.clear();
+	m_production.clear();
+}
+
+void send_tracker::acknowledge(std::uint32_t next_expected_event, clock::time_point now)
+{
+	// Ignore reordered heartbeats and ones which are still about previous game
+	if (next_expected_event <= m_acknowledged || next_expected_event > m_max_sent)
+		return;
+
+	// The latest fully acknowledged send is the closest to the heartbeat
+	bool has_sample = false;
+	in_flight_send sample;
+	while (!m_in_flight.empty() && m_in_flight.front().end <= next_expected_event)
+	{
+		sample = m_in_flight.front();
+		has_sample = true;
+		m_in_flight.pop_front();
+	}
+	if (has_sample && !sample.retransmitted)
+		add_rtt_sample(now - sample.time);
+
+	// Only grow the window if it was actually used, otherwise it would grow
+	// without bounds during regular game
+	if (m_window_limited)
+		grow_window(next_expected_event - m_acknowledged);
+
+	const size_t advanced = std::min<size_t>(next_expected_event - m_acknowledged,
+		m_selectively_acknowledged.size());
+	m_selectively_acknowledged.erase(m_selectively_acknowledged.begin(),
+		m_selectively_acknowledged.begin() + advanced);
+
+	m_acknowledged = next_expected_event;
+	m_next = std::max(m_next, m_acknowledged);
+	// Client makes progress, so drop the back off and give the rest of events
+	// a full timeout
+	update_retransmit_timeout();
+	m_timer_start = now;
+}
+
+void send_tracker::selectively_acknowledge(std::uint32_t event_no)
+{
+	// Only events which were sent can be received
+	if (event_no <= m_acknowledged || event_no >= m_max_sent)
+		return;
+
+	const size_t index = event_no - m_acknowledged;
+	if (index >= m_selectively_acknowledged.size())
+		m_selectively_acknowledged.resize(index + 1, false);
+	m_selectively_acknowledged[index] = true;
+
+	if (event_no - m_acknowledged >= REORDER_THRESHOLD)
+		m_lost_end = std::max(m_lost_end, event_no + 1 - REORDER_THRESHOLD);
+}
+
+send_tracker::range send_tracker::next_send(std::uint32_t event_count, clock::time_point now)
+{
+	record_production(event_count, now);
+
+	if (m_acknowledged < m_next && now - m_timer_start >= m_retransmit_timeout)
+		handle_timeout(now);
+	else if (m_lost_end > std::max(m_acknowledged, m_recovered_end))
+		start_fast_retransmit();
+
+	// When sending again, skip events the client already has and ones which
+	// didn't time out yet and stop before the next one it has
+	while (m_next < m_max_sent && is_selectively_acknowledged(m_next))
+		m_next++;
+	if (m_next >= m_resend_end && m_next < m_resume)
+		m_next = m_resume;
+	std::uint32_t end = m_next;
+	while (end < m_max_sent && !is_selectively_acknowledged(end))
+		end++;
+	if (end == m_max_sent)
+		end = event_count;
+	if (m_next < m_resend_end)
+		end = std::min(end, m_resend_end);
+
+	const std::uint32_t flight = in_flight();
+	const std::uint32_t available = end > m_next ? end - m_next : 0;
+	const std::uint32_t allowed = m_window > flight ? m_window - flight : 0;
+	if (available > allowed)
+		m_window_limited = true;
+
+	return range { m_next, std::min(available, allowed) };
+}
+
+void send_tracker::sent(std::uint32_t event_no, std::uint32_t count, size_t bytes,
+	clock::time_point now)
+{
+	const std::uint32_t end = event_no + count;
+	const bool resent = event_no < m_max_sent;
+
+	m_counters.bytes_sent += bytes;
+	m_counters.events_sent += count;
+	if (resent)
+		m_counters.events_resent += std::min(end, m_max_sent) - event_no;
+
+	if (m_acknowledged == m_next)
+	{
+		// Nothing was waiting for acknowledgement, so the timer starts now
+		m_timer_start = now;
+	}
+
+	m_next = end;
+	m_max_sent = std::max(m_max_sent, end);
+
+	if (m_in_flight.size() == MAX_IN_FLIGHT_SENDS)
+		m_in_flight.pop_front();
+	m_in_flight.push_back(in_flight_send { end, now, resent });
+}
+
+bool send_tracker::is_selectively_acknowledged(std::uint32_t event_no) const
+{
+	const size_t index = event_no - m_acknowledged;
+	return event_no > m_acknowledged && index < m_selectively_acknowledged.size()
+		&& m_selectively_acknowledged[index];
+}
+
+std::uint32_t send_tracker::in_flight() const
+{
+	const size_t sent = m_next - m_acknowledged;
+	const auto first = m_selectively_acknowledged.begin();
+	const auto received = std::count(first,
+		first + std::min(sent, m_selectively_acknowledged.size()), true);
+	return static_cast<std::uint32_t>(sent - received);
+}
+
+std::uint32_t send_tracker::acknowledged() const
+{
+	return m_acknowledged;
+}
+
+std::uint32_t send_tracker::window() const
+{
+	return m_window;
+}
+
+send_tracker::clock::duration send_tracker::smoothed_rtt() const
+{
+	return m_smoothed_rtt;
+}
+
+send_tracker::clock::duration send_tracker::retransmit_timeout() const
+{
+	return m_retransmit_timeout;
+}
+
+const send_tracker::counters& send_tracker::stats() const
+{
+	return m_counters;
+}
+
+void send_tracker::reset_stats()
+{
+	m_counters = counters();
+}
+
+void send_tracker::add_rtt_sample(clock::duration rtt)
+{
+	if (!m_has_rtt_sample)
+	{
+		m_smoothed_rtt = rtt;
+		m_rtt_variance = rtt / 2;
+		m_has_rtt_sample = true;
+	}
+	else
+	{
+		const clock::duration deviation = m_smoothed_rtt > rtt ? m_smoothed_rtt - rtt
+			: rtt - m_smoothed_rtt;
+		m_rtt_variance = (3 * m_rtt_variance + deviation) / 4;
+		m_smoothed_rtt = (7 * m_smoothed_rtt + rtt) / 8;
+	}
+
+	update_retransmit_timeout();
+}
+
+void send_tracker::update_retransmit_timeout()
+{
+	if (!m_has_rtt_sample)
+	{
+		m_retransmit_timeout = m_base_retransmit_timeout = INITIAL_RETRANSMIT_TIMEOUT;
+		return;
+	}
+
+	m_retransmit_timeout = std::min<clock::duration>(
+		std::max<clock::duration>(m_smoothed_rtt + 4 * m_rtt_variance, MIN_RETRANSMIT_TIMEOUT),
+		MAX_RETRANSMIT_TIMEOUT);
+	m_base_retransmit_timeout = m_retransmit_timeout;
+}
+
+void send_tracker::grow_window(std::uint32_t acknowledged_count)
+{
+	if (m_window < m_slow_start_threshold)
+	{
+		// Slow start, window doubles every round trip
+		m_window += acknowledged_count;
+	}
+	else
+	{
+		// Congestion avoidance, window grows by one event every round trip
+		m_window_growth += acknowledged_count;
+		while (m_window_growth >= m_window)
+		{
+			m_window_growth -= m_window;
+			m_window++;
+		}
+	}
+	m_window = std::min(m_window, MAX_WINDOW);
+	m_window_limited = false;
+}
+
+void send_tracker::handle_timeout(clock::time_point now)
+{
+	// Client stalled, so start over with the smallest window and grow it
+	// quickly only up to half of what was in flight
+	m_slow_start_threshold = std::max(in_flight() / 2, min_window());
+	m_window = min_window();
+	m_window_growth = 0;
+
+	// Events sent within the timeout may still arrive, so only go back over
+	// the ones sent before it (or all of them if we don't know when)
+	m_resend_end = m_next;
+	if (!m_in_flight.empty() && m_in_flight.front().time + m_retransmit_timeout <= now)
+	{
+		m_resend_end = m_acknowledged;
+		for (const auto& send : m_in_flight)
+		{
+			if (send.time + m_retransmit_timeout > now)
+				break;
+			m_resend_end = std::max(m_resend_end, send.end);
+		}
+	}
+	m_resume = m_next;
+
+	// Go back to the first unacknowledged event and back off until the client
+	// makes progress
+	const clock::duration max_timeout = produced_recently() > 0
+		? std::min<clock::duration>(m_base_retransmit_timeout * MAX_STREAMING_BACKOFF,
+			MAX_RETRANSMIT_TIMEOUT)
+		: clock::duration(MAX_RETRANSMIT_TIMEOUT);
+	m_retransmit_timeout = std::min(m_retransmit_timeout * 2, max_timeout);
+	m_next = m_acknowledged;
+	m_timer_start = now;
+
+	// Acknowledgements of earlier sends could now be of the retransmission as well
+	for (auto& send : m_in_flight)
+		send.retransmitted = true;
+}
+
+void send_tracker::start_fast_retransmit()
+{
+	// Like after timeout halve the window, but only once per window of events
+	if (m_acknowledged >= m_recovery_point)
+	{
+		m_slow_start_threshold = std::max(in_flight() / 2, min_window());
+		m_window = m_slow_start_threshold;
+		m_window_growth = 0;
+		m_recovery_point = m_max_sent;
+	}
+
+	// Go back over the holes which weren't sent again yet (or extend ongoing
+	// retransmission with them), continue with new events afterwards
+	const std::uint32_t first = std::max(m_acknowledged, m_recovered_end);
+	if (m_next < m_resend_end)
+	{
+		m_resend_end = std::max(m_resend_end, m_lost_end);
+	}
+	else
+	{
+		// Keep jump over events sent again after timeout if it's still pending
+		m_resume = std::max(m_resume, m_next);
+		m_resend_end = m_lost_end;
+		m_next = std::min(m_next, first);
+	}
+	m_recovered_end = m_lost_end;
+
+	// Acknowledgements of earlier sends could now be of the retransmission as well
+	for (auto& send : m_in_flight)
+		send.retransmitted = true;
+}
+
+void send_tracker::record_production(std::uint32_t event_count, clock::time_point now)
+{
+	while (!m_production.empty() && now - m_production.front().first > PRODUCTION_PERIOD)
+		m_production.pop_front();
+
+	// Event count of the oldest entry is kept as the baseline for the period
+	if (m_production.empty() || event_count > m_production.back().second)
+		m_production.emplace_back(now, event_count);
+}
+
+std::uint32_t send_tracker::produced_recently() const
+{
+	if (m_production.empty())
+		return 0;
+	return m_production.back().second - m_production.front().second;
+}
+
+std::uint32_t send_tracker::min_window() const
+{
+	const auto produced = static_cast<std::uint64_t>(produced_recently())
+		* 2 * m_base_retransmit_timeout.count() / clock::duration(PRODUCTION_PERIOD).count();
+	return static_cast<std::uint32_t>(std::min<std::uint64_t>(
+		std::max<std::uint64_t>(produced, MIN_WINDOW), MAX_WINDOW));
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <deque>
+#include <utility>
+
+// Tracks events sent to a single client and acknowledged by its heartbeats
+// (with next_expected_event), so only new events are sent right away and
+// unacknowledged ones are sent again only after a retransmission timeout.
+// The timeout is estimated from round trips like in TCP (RFC 6298), where
+// the round trip also includes the wait for the client's next heartbeat.
+// Events waiting for acknowledgement are limited by a send window, which
+// grows like TCP congestion window (slow start, then congestion avoidance)
+// while the client keeps acknowledging and collapses on timeout. Games stream
+// events in real time though, so neither the window nor the timeout back off
+// past what keeps up with the rate events are generated at.
+// Clients can also selectively acknowledge events past next_expected_event,
+// which are then skipped, so only the holes are sent again. Holes with enough
+// events after them acknowledged are considered lost and sent again right
+// away (fast retransmit), without waiting for the timeout.
+class send_tracker
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	// Clients acknowledge events only every 20 ms, anything shorter would
+	// mostly retransmit events which simply weren't acknowledged yet
+	constexpr static std::chrono::milliseconds MIN_RETRANSMIT_TIMEOUT { 30 };
+	constexpr static std::chrono::milliseconds INITIAL_RETRANSMIT_TIMEOUT { 100 };
+	constexpr static std::chrono::milliseconds MAX_RETRANSMIT_TIMEOUT { 1000 };
+	// While events keep being generated, timeout backs off at most this many
+	// times, so the client doesn't fall further and further behind
+	constexpr static unsigned MAX_STREAMING_BACKOFF = 2;
+	// Event generation rate is measured over this period
+	constexpr static std::chrono::milliseconds PRODUCTION_PERIOD { 1000 };
+
+	// Send window bounds, in events
+	constexpr static std::uint32_t MIN_WINDOW = 4;
+	constexpr static std::uint32_t INITIAL_WINDOW = 16;
+	constexpr static std::uint32_t MAX_WINDOW = 4096;
+	// How many later events have to be received before a hole is considered
+	// lost rather than reordered
+	constexpr static std::uint32_t REORDER_THRESHOLD = 3;
+
+	struct range
+	{
+		std::uint32_t first;
+		std::uint32_t count;
+	};
+
+	struct counters
+	{
+		std::uint64_t bytes_sent = 0; // datagram payloads, without UDP/IP headers
+		std::uint64_t events_sent = 0;
+		std::uint64_t events_resent = 0; // events which were already sent before
+
+		double duplicate_ratio() const;
+	};
+
+	// Forgets about sent events, e.g. for a new game (keeps the round trip
+	// estimate, send window and counters)
+	void restart();
+	// Handles next_expected_event from the client's heartbeat
+	void acknowledge(std::uint32_t next_expected_event, clock::time_point now);
+	// Handles event past next_expected_event which the client reported as
+	// received, it won't be sent again
+	void selectively_acknowledge(std::uint32_t event_no);
+	// Events out of event_count which should be sent now, as many as the send
+	// window allows: starting with the first unacknowledged one if
+	// retransmission timeout expired, otherwise with the first one not sent yet
+	range next_send(std::uint32_t event_count, clock::time_point now);
+	// Records that count events starting with event_no were sent in bytes
+	void sent(std::uint32_t event_no, std::uint32_t count, size_t bytes,
+		clock::time_point now);
+
+	std::uint32_t acknowledged() const;
+	std::uint32_t window() const;
+	clock::duration smoothed_rtt() const;
+	clock::duration retransmit_timeout() const;
+
+	const counters& stats() const;
+	void reset_stats();
+
+private:
+	// Sends waiting for acknowledgement, used to take round trip samples
+	struct in_flight_send
+	{
+		std::uint32_t end; // event_no after the last sent event
+		clock::time_point time;
+		bool retransmitted; // contained already sent events, so sample would be ambiguous
+	};
+	constexpr static size_t MAX_IN_FLIGHT_SENDS = 64;
+
+	bool is_selectively_acknowledged(std::uint32_t event_no) const;
+	// Sent events neither acknowledged nor selectively acknowledged
+	std::uint32_t in_flight() const;
+	void add_rtt_sample(clock::duration rtt);
+	void update_retransmit_timeout();
+	void grow_window(std::uint32_t acknowledged_count);
+	void handle_timeout(clock::time_point now);
+	void start_fast_retransmit();
+	void record_production(std::uint32_t event_count, clock::time_point now);
+	// Events generated within PRODUCTION_PERIOD
+	std::uint32_t produced_recently() const;
+	// Window can't shrink below what is generated within two (not backed off)
+	// timeouts, otherwise retransmissions couldn't keep up with new events
+	std::uint32_t min_window() const;
+
+	std::uint32_t m_acknowledged = 0;
+	std::uint32_t m_next = 0; // next event to send (rewound after timeout)
+	// After timeout, only events before m_resend_end timed out, so once they're
+	// sent again sending continues with m_resume
+	std::uint32_t m_resend_end = 0;
+	std::uint32_t m_resume = 0;
+	// Holes before m_lost_end are considered lost, ones before m_recovered_end
+	// were already sent again
+	std::uint32_t m_lost_end = 0;
+	std::uint32_t m_recovered_end = 0;
+	// Window is reduced at most once until events sent before it are acknowledged
+	std::uint32_t m_recovery_point = 0;
+	std::uint32_t m_max_sent = 0; // event_no after the last event ever sent
+	clock::time_point m_timer_start; // since when first unacknowledged event waits
+	std::deque<in_flight_send> m_in_flight;
+	// Indexed by event_no - m_acknowledged, missing ones weren't acknowledged
+	std::deque<bool> m_selectively_acknowledged;
+
+	bool m_has_rtt_sample = false;
+	clock::duration m_smoothed_rtt { 0 };
+	clock::duration m_rtt_variance { 0 };
+	clock::duration m_retransmit_timeout { INITIAL_RETRANSMIT_TIMEOUT };
+	clock::duration m_base_retransmit_timeout { INITIAL_RETRANSMIT_TIMEOUT }; // without back off
+
+	// (time, event_count) whenever event_count passed to next_send grew
+	// within PRODUCTION_PERIOD, oldest first
+	std::deque<std::pair<clock::time_point, std::uint32_t>> m_production;
+
+	std::uint32_t m_window = INITIAL_WINDOW;
+	std::uint32_t m_slow_start_threshold = MAX_WINDOW;
+	std::uint32_t m_window_growth = 0; // events acknowledged towards next increment
+	bool m_window_limited = false; // had more to send than window allowed
+
+	counters m_counters;
+};
@@ -10,11 +10,13 @@
 #include <ctime>
 #include <set>
 #include <map>
+#include <deque>
 #include <memory>
 #include <chrono>
 #include <algorithm>
 #include <array>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 
 #ifdef _WIN32
@@ -33,10 +35,24 @@ using ssize_t = SSIZE_T;
 #include <endian.h>
 #endif
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#endif
+
 #include "protocol.h"
 #include "util.h"
 #include "rand.h"
 #include "map.h"
+#include "motion.h"
+#include "batch_io.h"
+#include "io_ring.h"
+#include "tick_scheduler.h"
+#include "event_log.h"
+#include "send_tracker.h"
 
 using namespace std::chrono;
 
@@ -50,13 +66,20 @@ constexpr const char* usage_msg =
 "          ROUNDS_PER_SEC w opisie protokołu, domyślnie 50)\n"
 "  -t n – liczba całkowita wyznaczająca szybkość skrętu (parametr\n"
 "          TURNING_SPEED, domyślnie 6)\n"
-"  -r n – ziarno generatora liczb losowych (opisanego poniżej)\n";
+"  -r n – ziarno generatora liczb losowych (opisanego poniżej)\n"
+"  -m tryb – obsługa sieci: threads (domyślnie), epoll lub io_uring (jeśli dostępne)\n";
 
 constexpr int MAX_CLIENTS = 42;
 constexpr std::chrono::milliseconds CLIENT_CONNECTION_TIMEOUT = 2000ms;
 
 static Rand rand_gen;
 
+enum class server_mode {
+	threads, // separate threads for receiving, sending and game updates
+	epoll, // single thread with epoll on the socket and timerfd for rounds
+	io_uring, // single thread driven by io_uring completions
+};
+
 static struct {
 	std::uint32_t width = 800;
 	std::uint32_t height = 600;
@@ -65,28 +88,35 @@ static struct {
 	std::uint32_t turning_speed = 6;
 	std::uint32_t rand_seed;
 	bool seed_provided = false;
+	server_mode mode = server_mode::threads;
 } configuration;
 
-static std::chrono::microseconds round_budget_microseconds()
+static std::chrono::nanoseconds round_budget()
 {
 	using namespace std::chrono_literals;
 
-	auto budget = std::chrono::milliseconds{ 1s } / configuration.rounds_per_sec;
-	return budget;
+	// Nanosecond precision, so that long-run tick rate matches ROUNDS_PER_SEC
+	// (over 10^9 rounds per second it can't, but the budget mustn't be 0)
+	auto budget = std::chrono::nanoseconds{ 1s } / configuration.rounds_per_sec;
+	return std::max(budget, std::chrono::nanoseconds{ 1 });
 }
 
+// Only used to measure time intervals, so use monotonic clock which is
+// immune to wall-clock changes
 std::chrono::microseconds current_time_microseconds()
 {
 	return duration_cast<std::chrono::microseconds>(
-		system_clock::now().time_since_epoch());
+		steady_clock::now().time_since_epoch());
 }
 
 std::chrono::milliseconds current_time_ms()
 {
 	return duration_cast<std::chrono::milliseconds>(
-		system_clock::now().time_since_epoch());
+		steady_clock::now().time_since_epoch());
 }
 
+static tick_scheduler round_scheduler;
+
 // Players are identified by (socket, session_id) pair
 enum client_state {
 	playing, // actively playing now during current game
@@ -102,8 +132,10 @@ struct client_connection {
 
 	client_message last_message;
 	std::chrono::milliseconds last_message_time;
+	std::chrono::milliseconds last_selective_ack_time { 0 };
 
 	server_player* player = nullptr;
+	send_tracker sent_events;
 
 	bool ready_to_play = false; // pressed arrow when waiting for NEW_GAME
 	client_state state = client_state::spectating;
@@ -126,12 +158,9 @@ struct player
 	bool eliminated = false;
 };
 
+// Movement state is kept separately in game_state.motion, indexed by player_id
 struct server_player : public player
 {
-	double x = 0;
-	double y = 0;
-	double rotation = 0; // in degrees, clockwise, 0* = right
-	std::uint8_t turn_direction = 0;
 	client_connection* connection = nullptr;
 };
 
@@ -183,19 +212,64 @@ static struct {
 	std::uint32_t game_id;
 	bool in_progress = false;
 	struct map map;
-	std::vector<std::shared_ptr<event>> events;
+	event_log events;
 
 	player_collection_t clients;
 
 	// Cached players with ordering for given game (reinitialized for every game)
 	std::vector<server_player> players;
+	std::vector<std::string> player_names; // as sent in NEW_GAME
+	player_motion motion;
 
 	std::recursive_mutex lock; // TODO: Replace with fair, priority mutex
-	// Since clients only have next_expected_event, use this flag to tell sender thread
-	// to ignore it and inform client regardless of their last next_expected_event
-	bool send_new_events = false;
+	// Events were generated since the last send pass, which should run now
+	bool events_pending = false;
+	// Wakes up the sender thread when events_pending is set
+	std::condition_variable_any events_generated;
 } game_state;
 
+// Measures how late game rounds are run, reported after every game together
+// with the round scheduler counters
+static struct {
+	std::uint64_t wakeups = 0;
+	std::chrono::microseconds total_lateness { 0 };
+	std::chrono::microseconds max_lateness { 0 };
+
+	void record(std::chrono::microseconds lateness)
+	{
+		wakeups++;
+		total_lateness += lateness;
+		max_lateness = std::max(max_lateness, lateness);
+	}
+
+	void report_and_reset()
+	{
+		const auto& counters = round_scheduler.stats();
+		if (wakeups > 0)
+		{
+			double cpu_ms = 0;
+#ifdef __linux__
+			rusage usage;
+			if (getrusage(RUSAGE_SELF, &usage) == 0)
+				cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3
+					+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+#endif
+			fprintf(stderr, "Tick stats: %llu rounds (%llu overruns, %llu caught up, "
+				"%llu skipped), lateness mean %lld us, max %lld us, "
+				"process CPU time %.1f ms, %zu clients\n",
+				(unsigned long long)counters.ticks,
+				(unsigned long long)counters.overruns,
+				(unsigned long long)counters.caught_up,
+				(unsigned long long)counters.skipped,
+				(long long)(total_lateness.count() / wakeups),
+				(long long)max_lateness.count(), cpu_ms, game_state.clients.size());
+		}
+		wakeups = 0;
+		total_lateness = max_lateness = std::chrono::microseconds::zero();
+		round_scheduler.reset_stats();
+	}
+} tick_stats;
+
 void prune_inactive_clients()
 {
 	for (auto it = game_state.clients.begin(); it != game_state.clients.end();)
@@ -214,6 +288,29 @@ void prune_inactive_clients()
 	}
 }
 
+// Reports and resets per client counters of sent events
+void report_send_stats()
+{
+	for (auto& client_kv : game_state.clients)
+	{
+		auto& sent_events = client_kv.second.sent_events;
+		const auto& counters = sent_events.stats();
+		const char* name = client_kv.second.last_message.player_name;
+
+		fprintf(stderr, "Send stats for %s: %llu bytes, %llu events (%.1f%% duplicates), "
+			"smoothed RTT %lld us, retransmission timeout %lld us, window %u events\n",
+			name[0] != '\0' ? name : "spectator",
+			(unsigned long long)counters.bytes_sent,
+			(unsigned long long)counters.events_sent,
+			counters.duplicate_ratio() * 100.0,
+			(long long)duration_cast<std::chrono::microseconds>(sent_events.smoothed_rtt()).count(),
+			(long long)duration_cast<std::chrono::microseconds>(
+				sent_events.retransmit_timeout()).count(),
+			(unsigned)sent_events.window());
+		sent_events.reset_stats();
+	}
+}
+
 // TODO: FACTOR OUT SERVER STATE AND CONTAINING RANDOM GENERATOR, CONFIGURATION, OPEN SOCKET AND PLAYER CONNECTIONS
 // + PLAYER GAME STATE
 // STRUCTS AND DEFS COULD BE IN SERVER.H AND THIS FILE WOULD ONLY BASICALLY PARSE ARGS, OPEN SOCKET
@@ -221,7 +318,7 @@ void prune_inactive_clients()
 void cleanup_game()
 {
 	game_state.in_progress = false;
-	game_state.map = map(configuration.width, configuration.height);
+	game_state.map.clear();
 
 	for (auto& client_kv : game_state.clients)
 	{
@@ -236,80 +333,54 @@ void cleanup_game()
 		}
 	}
 	game_state.players.clear();
+	game_state.player_names.clear();
+	game_state.motion.clear();
+
+	tick_stats.report_and_reset();
+	report_send_stats();
 }
 
 static int server_socket;
 
-// Returns how many events were sent to client
-int broadcast_events(const std::vector<std::shared_ptr<event>>& events,
+// Bounds bytes of events sent in a single pass (over all clients), or in
+// replies to a single batch of received datagrams, so e.g. many clients
+// catching up at once don't overflow the socket send buffer
+constexpr size_t SEND_PASS_BYTE_BUDGET = 64 * 1024;
+
+// Queues datagrams with events the client should get now in the batch: ones
+// it wasn't sent yet and, after retransmission timeout, unacknowledged ones.
+// Sends as many as client's send window and remaining byte_budget of the pass
+// allow. Returns how many events were queued.
+int broadcast_events(datagram_batch& batch,
+	event_log& events,
 	std::uint32_t game_id,
-	const sockaddr_storage& client_socket,
-	std::uint32_t next_expected_event,
-	size_t max_send_count = 5)
+	client_connection& client,
+	send_tracker::clock::time_point now,
+	size_t& byte_budget)
 {
-	const auto event_count = events.size();
-	if (next_expected_event > event_count)
-		return 0;
+	const auto range = client.sent_events.next_send(events.size(), now);
+	const size_t count = events.count_within(range.first, range.count, byte_budget);
 
-	auto send_count = std::min(event_count - next_expected_event, max_send_count);
-	if (send_count == 0)
+	// Clients starting with the same event share the same datagrams
+	const datagram_slice datagrams = events.datagrams(game_id, range.first, count);
+	if (datagrams.run == nullptr)
 		return 0;
 
-	server_message msg;
-	msg.game_id = game_id;
-
-	size_t sent = 0;
-	while (sent < send_count)
-	{
-		msg.events.clear();
-
-		// Try to split and pack requested events into different server_messages
-		// respecting maximum size of events packet data payload
-		int events_size = 0;
-		for (; sent < send_count; ++sent)
-		{
-			const auto& event = events[next_expected_event + sent];
-			const auto event_length = event->calculate_total_len_with_crc32();
-
-			if (events_size + event_length > server_message::MAX_EVENTS_LEN)
-				break;
-			
-			events_size += event_length;
-			msg.events.push_back(event);
-		}
-
-		const auto buffer = msg.as_stream();
-		if (buffer.size() != sizeof(msg.game_id) + events_size) {
-			fprintf(stderr, "Mismatch between size of serialized and prepared server_message");
-		}
-
-		int flags = 0;
-#ifdef linux
-		flags = MSG_DONTWAIT;
-#endif
-
-		ssize_t snd_len = sendto(server_socket, (const char*)buffer.data(), buffer.size(), flags,
-			(sockaddr*)&client_socket, sizeof(client_socket));
-
-		const bool would_block = errno == EAGAIN || errno == EWOULDBLOCK;
-
-		if (!would_block && snd_len != static_cast<ssize_t>(buffer.size()))
-			fprintf(stderr, "Error sending event: %s\n", buffer.data());
-	}
-
-	return sent;
+	byte_budget -= std::min(byte_budget, datagrams.length);
+	client.sent_events.sent(range.first, datagrams.event_count, datagrams.length, now);
+	batch.add(client.socket, datagrams.run, datagrams.datagram_count);
+	return datagrams.event_count;
 }
 
-void generate_event(std::shared_ptr<event> event)
+void generate_event(event event)
 {
-	// First broadcast the event
-	event->event_no = game_state.events.size();
-	game_state.events.push_back(event);
-
-	auto raw_event = event.get();
+	// First broadcast the event, it's serialized only once here
+	event.event_no = game_state.events.size();
+	game_state.events.append(event, game_state.player_names);
+	game_state.events_pending = true;
 
 	// Then act accordingly
-	switch (event->event_type)
+	switch (event.event_type)
 	{
 	// try_start_game is the only function responsible for generating NEW_GAME
 	// and is already initializing game, so don't do anything here
@@ -317,14 +388,14 @@ void generate_event(std::shared_ptr<event> event)
 		break;
 	case PIXEL:
 	{
-		pixel* pixel_event = static_cast<pixel*>(raw_event);
+		const pixel& pixel_event = event.pixel_data;
 
-		game_state.map.pixels.insert(map::make_pos(pixel_event->x, pixel_event->y));
+		game_state.map.set_occupied(map::make_pos(pixel_event.x, pixel_event.y));
 		break;
 	}
 	case PLAYER_ELIMINATED:
 	{
-		std::int8_t player_num = static_cast<player_eliminated*>(raw_event)->player_number;
+		std::int8_t player_num = event.player_eliminated_data.player_number;
 		game_state.players[player_num].eliminated = true;
 
 		int living_count = 0;
@@ -332,7 +403,7 @@ void generate_event(std::shared_ptr<event> event)
 			living_count += player.eliminated ? 0 : 1;
 
 		if (living_count == 1)
-			generate_event(std::make_shared<game_over>());
+			generate_event(game_over {});
 		break;
 	}
 	case GAME_OVER:
@@ -340,7 +411,7 @@ void generate_event(std::shared_ptr<event> event)
 		cleanup_game();
 		break;
 	}
-	default: fprintf(stderr, "Generating unknown message (type: %d)\n", event->event_type);
+	default: fprintf(stderr, "Generating unknown message (type: %d)\n", event.event_type);
 	}
 }
 
@@ -394,7 +465,8 @@ bool try_start_game()
 			}
 		);
 
-		std::vector<std::string> player_names(player_count);
+		auto& player_names = game_state.player_names;
+		player_names.resize(player_count);
 		for (size_t i = 0; i < player_count; ++i)
 		{
 			server_player& player = game_state.players[i];
@@ -406,24 +478,29 @@ bool try_start_game()
 		// Use exact specified order/algorithm from the assignment
 		game_state.game_id = rand_gen.next();
 		game_state.in_progress = true;
-		game_state.send_new_events = true;
 		game_state.events.clear();
+		// Clients' next_expected_event are about the previous game now
+		for (auto& client_kv : game_state.clients)
+			client_kv.second.sent_events.restart();
 
-		generate_event(std::make_shared<new_game>(game_state.map.width, game_state.map.height,
-			player_names));
+		generate_event(new_game { game_state.map.width, game_state.map.height });
 
+		auto& motion = game_state.motion;
+		motion.resize(player_count);
 		for (auto& player : game_state.players)
 		{
-			player.x = (rand_gen.next() % game_state.map.width) + 0.5f; // TODO: Verify if width == maxx
-			player.y = (rand_gen.next() % game_state.map.height) + 0.5f; // ^ for height
-			player.rotation = (rand_gen.next() % 360);
-
-			if (game_state.map.is_occupied(player.x, player.y))
-				generate_event(std::make_shared<player_eliminated>(player.player_id));
+			const auto id = player.player_id;
+			motion.x[id] = (rand_gen.next() % game_state.map.width) + 0.5f; // TODO: Verify if width == maxx
+			motion.y[id] = (rand_gen.next() % game_state.map.height) + 0.5f; // ^ for height
+			motion.rotation[id] = (rand_gen.next() % 360);
+			motion.turn_direction[id] = 0;
+
+			if (game_state.map.is_occupied(motion.x[id], motion.y[id]))
+				generate_event(player_eliminated { player.player_id });
 			else
 			{
-				const auto pos = map::make_pos(player.x, player.y);
-				generate_event(std::make_shared<pixel>(player.player_id, pos.first, pos.second));
+				const auto pos = motion.position(id);
+				generate_event(pixel { player.player_id, pos.first, pos.second });
 			}
 		}
 	}
@@ -431,7 +508,8 @@ bool try_start_game()
 	return true;
 }
 
-void handle_client_message(const client_message& msg, const struct sockaddr_storage& sock)
+// Returns whether the message was accepted (and not ignored e.g. as a flood)
+bool handle_client_message(const client_message& msg, const struct sockaddr_storage& sock)
 {
 	const bool wants_to_spectate = (strlen(msg.player_name) == 0);
 
@@ -443,11 +521,12 @@ void handle_client_message(const client_message& msg, const struct sockaddr_stor
 		const auto cur_session_id = client.last_message.session_id;
 		// Ignore incoming messages for existing client with lower session_id
 		if (msg.session_id < cur_session_id)
-			return;
+			return false;
 		// If incoming session_id is bigger for existing client then disconnect
 		// existing one and replace with the new one
 		else if (msg.session_id > cur_session_id)
 		{
+			client.sent_events.restart();
 			client.ready_to_play = false;
 			client.player = nullptr; // disconnect from the player in case he's playing now
 			client.state = wants_to_spectate ? client_state::spectating : client_state::waiting;
@@ -455,7 +534,7 @@ void handle_client_message(const client_message& msg, const struct sockaddr_stor
 		// Existing client tries to flood us, ignore it
 		else if (current_time_ms() - client.last_message_time < MIN_MESSAGE_DELAY)
 		{
-			return;
+			return false;
 		}
 	}
 	// New client joined
@@ -463,7 +542,7 @@ void handle_client_message(const client_message& msg, const struct sockaddr_stor
 	{
 		// Respect limit of connected clients
 		if (game_state.clients.size() >= MAX_CLIENTS)
-			return;
+			return false;
 
 		it = std::find_if(game_state.clients.begin(), game_state.clients.end(),
 			[&msg](const auto& client_kv)
@@ -473,7 +552,7 @@ void handle_client_message(const client_message& msg, const struct sockaddr_stor
 		);
 		// Ignore messages from unknown socket with the same name as existing client (incl. spectators)
 		if (it != game_state.clients.end())
-			return;
+			return false;
 
 		client_connection client;
 		client.socket = sock;	
@@ -485,6 +564,7 @@ void handle_client_message(const client_message& msg, const struct sockaddr_stor
 	client_connection& client = it->second;
 	client.last_message = msg;
 	client.last_message_time = current_time_ms();
+	client.sent_events.acknowledge(msg.next_expected_event, send_tracker::clock::now());
 
 	// Handle possible game state change
 	if (wants_to_spectate)
@@ -495,7 +575,7 @@ void handle_client_message(const client_message& msg, const struct sockaddr_stor
 	}
 	else if (client.is_playing())
 	{
-		client.player->turn_direction = msg.turn_direction;
+		game_state.motion.turn_direction[client.player->player_id] = msg.turn_direction;
 	}
 	// Wants to play but doesn't yet
 	else if (!game_state.in_progress && msg.turn_direction != 0)
@@ -505,32 +585,56 @@ void handle_client_message(const client_message& msg, const struct sockaddr_stor
 		// If we managed to start a game, we generated NEW_GAME and sent appropriate
 		// events to all other players; don't do it now
 		if (try_start_game())
-			return;
+			return true;
 	}
+	return true;
 }
 
-void do_game_tick()
+// Applies selective acknowledgement of existing client, returns whether it
+// was accepted
+bool handle_selective_ack(const selective_ack& ack, const sockaddr_storage& sock)
 {
-	for (auto& player : game_state.players)
-	{
-		player.rotation += player.turn_direction * configuration.turning_speed;
-		player.rotation = fmod(player.rotation, 360);
+	auto it = game_state.clients.find(sock);
+	if (it == game_state.clients.end())
+		return false;
 
-		auto old_pos = map::make_pos(player.x, player.y);
-		// Rotation are degrees going clock-wise, so negate deg for (cos deg, sin deg) unit vector
-		// Move by a unit in given direction
-		player.x += cos(-player.rotation * M_PI / 180);
-		player.y += sin(-player.rotation * M_PI / 180);
+	client_connection& client = it->second;
+	// Only accept it from the current session, about the current game and at
+	// most as often as heartbeats
+	if (ack.session_id != client.last_message.session_id
+		|| ack.game_id != game_state.game_id
+		|| current_time_ms() - client.last_selective_ack_time < MIN_MESSAGE_DELAY)
+		return false;
+	client.last_selective_ack_time = current_time_ms();
 
-		auto new_pos = map::make_pos(player.x, player.y);
+	auto& sent_events = client.sent_events;
+	sent_events.acknowledge(ack.next_expected_event, send_tracker::clock::now());
+	for (std::uint32_t i = 1; i <= ack.bitmap_len * 8; ++i)
+	{
+		if (ack.has(ack.next_expected_event + i))
+			sent_events.selectively_acknowledge(ack.next_expected_event + i);
+	}
+	return true;
+}
 
-		if (old_pos == new_pos)
+void do_game_tick()
+{
+	// Players move independently of each other, so move all of them at once
+	// and only then handle collisions and events in player order
+	auto& motion = game_state.motion;
+	motion.advance(configuration.turning_speed);
+
+	for (auto& player : game_state.players)
+	{
+		if (!motion.moved[player.player_id])
 			continue;
 
+		auto new_pos = motion.position(player.player_id);
+
 		if (!game_state.map.is_inside(new_pos) || game_state.map.is_occupied(new_pos))
-			generate_event(std::make_shared<player_eliminated>(player.player_id));
+			generate_event(player_eliminated { player.player_id });
 		else
-			generate_event(std::make_shared<pixel>(player.player_id, new_pos.first, new_pos.second));
+			generate_event(pixel { player.player_id, new_pos.first, new_pos.second });
 
 		// After every player update we need to check if the game has finished
 		// if so, the players are invalid, so just exit the game
@@ -539,114 +643,639 @@ void do_game_tick()
 	}
 }
 
+// Runs single game round, expects game state to be locked
+void game_tick()
+{
+	static int tick_count = 1;
+
+	if (game_state.in_progress)
+	{
+		do_game_tick();
+	}
+
+	constexpr int PRUNE_EVERY_TICKS = 15;
+	tick_count = (tick_count + 1) % PRUNE_EVERY_TICKS;
+	if (tick_count == 0)
+	{
+		prune_inactive_clients();
+	}
+}
+
+// Starts scheduling rounds from now on
+void start_rounds()
+{
+	round_scheduler = tick_scheduler(round_budget());
+	round_scheduler.start(tick_scheduler::clock::now());
+}
+
+// Runs all rounds that are due now (more than one if we need to catch up),
+// expects game state to be locked
+void run_due_rounds()
+{
+	const auto now = tick_scheduler::clock::now();
+	const auto deadline = round_scheduler.next_deadline();
+
+	const unsigned rounds = round_scheduler.ticks_due(now);
+	if (rounds == 0)
+		return;
+
+	tick_stats.record(duration_cast<std::chrono::microseconds>(now - deadline));
+	for (unsigned i = 0; i < rounds; ++i)
+		game_tick();
+}
+
 void update_game_job()
 {
-	int tick_count = 1;
+	tick_scheduler::clock::time_point deadline;
+	{
+		std::lock_guard<std::recursive_mutex> _lock(game_state.lock);
+		start_rounds();
+		deadline = round_scheduler.next_deadline();
+	}
+
 	while (true)
 	{
-		auto start_time = current_time_microseconds();
+		std::this_thread::sleep_until(deadline);
 		{
 			std::lock_guard<std::recursive_mutex> _lock(game_state.lock);
 
-			if (game_state.in_progress)
-			{
-				do_game_tick();
-			}
-
-			constexpr int PRUNE_EVERY_TICKS = 15;
-			tick_count = (tick_count + 1) % PRUNE_EVERY_TICKS;
-			if (tick_count == 0)
-			{
-				prune_inactive_clients();
-			}
-		}
-		auto elapsed = current_time_microseconds() - start_time;
-		if (elapsed < round_budget_microseconds())
-		{
-			auto remainder = round_budget_microseconds() - elapsed;
-			std::this_thread::sleep_for(remainder);
+			run_due_rounds();
+			deadline = round_scheduler.next_deadline();
+			if (game_state.events_pending)
+				game_state.events_generated.notify_one();
 		}
 	}
 }
 
+// Queues events missing by the client that just sent us a heartbeat, so it
+// doesn't have to wait for the next sender pass. Replies to a whole batch of
+// received datagrams share byte_budget.
+void queue_reply(datagram_batch& replies, const sockaddr_storage& client_address,
+	size_t& byte_budget)
+{
+	auto it = game_state.clients.find(client_address);
+	if (it == game_state.clients.end())
+		return;
+
+	broadcast_events(replies, game_state.events, game_state.game_id, it->second,
+		send_tracker::clock::now(), byte_budget);
+}
+
+// Parses and handles single datagram from the client and queues reply for it,
+// expects game state to be locked
+void handle_client_datagram(const char* buffer, size_t len, bool truncated,
+	const sockaddr_storage& client_address, datagram_batch& replies, size_t& reply_budget)
+{
+	if (truncated) {
+		fprintf(stderr, "read from socket message exceeding %zu bytes, ignoring\n",
+			datagram_receiver::MAX_DATAGRAM_SIZE);
+		return;
+	}
+
+	fprintf(stderr, "read from socket: %zu bytes: %.*s\n", len, (int)len, buffer);
+
+	// Selective acknowledgements aren't valid heartbeats, so check them first
+	auto parsed_ack = selective_ack::from(buffer, len);
+	if (parsed_ack.second)
+	{
+		if (handle_selective_ack(parsed_ack.first, client_address))
+			queue_reply(replies, client_address, reply_budget);
+		return;
+	}
+
+	auto parsed_msg = client_message::from(buffer, len);
+	if (parsed_msg.second == false) {
+		fprintf(stderr, "Error parsing message (hex): ");
+		for (size_t i = 0; i < len; ++i)
+			fprintf(stderr, "%02X", buffer[i]);
+		fprintf(stderr, "\n");
+	}
+	else if (handle_client_message(parsed_msg.first, client_address))
+	{
+		queue_reply(replies, client_address, reply_budget);
+	}
+}
+
 void receive_messages_job()
 {
-	constexpr int MSG_BUFFER_SIZE = 10000;
-	char buffer[MSG_BUFFER_SIZE];
-	struct sockaddr_storage client_address;
+	datagram_receiver receiver(server_socket);
+	datagram_batch replies(server_socket);
 
 	while (true)
 	{
-		socklen_t rcva_len = (socklen_t) sizeof(client_address);
-		ssize_t len = recvfrom(server_socket, buffer, sizeof(buffer), 0,
-			(struct sockaddr *) &client_address, &rcva_len);
-		if (len < 0)
+		const int count = receiver.receive();
+		if (count < 0)
 		{
 			fprintf(stderr, "error on datagram from client socket\n");
 			continue;
 		}
 
-		if (len > MSG_BUFFER_SIZE) {
-			fprintf(stderr, "read from socket message exceeding %d bytes, ignoring\n", MSG_BUFFER_SIZE);
-			continue;
-		}
-
-		fprintf(stderr, "read from socket: %zd bytes: %.*s\n", len, (int)len, buffer);
-		auto parsed_msg = client_message::from(buffer, len);
-		if (parsed_msg.second == false) {
-			fprintf(stderr, "Error parsing message (hex): ");
-			for (int i = 0; i < len; ++i)
-				fprintf(stderr, "%02X", buffer[i]);
-			fprintf(stderr, "\n");
-		}
-		else
+		// Handle whole batch of datagrams with a single lock
 		{
 			// TODO: Replace with fair, low priority lock
 			std::lock_guard<std::recursive_mutex> _lock(game_state.lock);
-
-			handle_client_message(parsed_msg.first, client_address);
+			size_t reply_budget = SEND_PASS_BYTE_BUDGET;
+			for (int i = 0; i < count; ++i)
+			{
+				handle_client_datagram(receiver.data(i), receiver.length(i),
+					receiver.truncated(i), receiver.address(i), replies, reply_budget);
+			}
+			// Starting a game generates NEW_GAME
+			if (game_state.events_pending)
+				game_state.events_generated.notify_one();
 		}
+		// Reply after releasing the lock; sending doesn't block, so a slow
+		// client can't hold up receiving from others
+		replies.flush();
 	}
 }
 
-void send_events_job()
+// Queues missing events for every client, expects game state to be locked
+void queue_events(datagram_batch& batch)
 {
-	constexpr std::chrono::milliseconds SEND_INTERVAL { 5 };
+	game_state.events_pending = false;
+
+	auto& clients = game_state.clients;
+	if (clients.empty())
+		return;
+
+	// Start with a different client every pass, so no one is starved when the
+	// byte budget runs out
+	static size_t first_client = 0;
+	first_client = (first_client + 1) % clients.size();
+	const auto first = std::next(clients.begin(), first_client);
+
+	const auto now = send_tracker::clock::now();
+	size_t byte_budget = SEND_PASS_BYTE_BUDGET;
+	auto it = first;
+	do
+	{
+		broadcast_events(batch, game_state.events, game_state.game_id, it->second, now,
+			byte_budget);
+		if (++it == clients.end())
+			it = clients.begin();
+	} while (it != first && byte_budget > 0);
+}
 
-	std::uint32_t game_id;
-	std::vector<std::shared_ptr<event>> events;
-	std::map<sockaddr_storage, uint32_t, in6_addr_port_compare> clients;
+// Pushes new events to clients as soon as they're generated. Events lost on
+// the way are sent again in replies to client heartbeats, so there's no need
+// to wake up periodically.
+void send_events_job()
+{
+	datagram_batch batch(server_socket);
 	while (true)
 	{
-		// We can afford to send stale data, so lock for a short period of time and copy data for sending
+		// Only prepare datagrams under the lock, send them after releasing it
 		{
 			// TODO: Replace with fair, low priority lock
-			std::lock_guard<std::recursive_mutex> _lock(game_state.lock);
-			game_id = game_state.game_id;
-			events = game_state.events;
+			std::unique_lock<std::recursive_mutex> lock(game_state.lock);
+			game_state.events_generated.wait(lock, [] { return game_state.events_pending; });
+			queue_events(batch);
+		}
+		// Send datagrams for all the clients at once
+		batch.flush();
+	}
+}
 
-			clients.clear();
-			for (auto& kv : game_state.clients)
+void run_threads()
+{
+	std::thread recv(receive_messages_job);
+	std::thread send(send_events_job);
+	std::thread update(update_game_job);
+
+	recv.join();
+	send.join();
+	update.join();
+}
+
+#ifdef __linux__
+namespace epoll_loop {
+	int create_timer(const itimerspec& spec, int flags = 0)
+	{
+		int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0)
+			return -1;
+
+		if (timerfd_settime(fd, flags, &spec, nullptr) < 0)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	// One-shot expiration at the absolute steady_clock (CLOCK_MONOTONIC) time
+	itimerspec at(tick_scheduler::clock::time_point deadline)
+	{
+		const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			deadline.time_since_epoch()).count();
+		itimerspec spec;
+		memset(&spec, 0x00, sizeof(spec));
+		spec.it_value.tv_sec = ns / 1000000000;
+		spec.it_value.tv_nsec = ns % 1000000000;
+		return spec;
+	}
+
+	// Returns number of timer expirations since last read
+	std::uint64_t read_timer(int fd)
+	{
+		std::uint64_t expirations = 0;
+		if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+			return 0;
+		return expirations;
+	}
+
+	// Closes the descriptor when leaving the scope
+	struct fd_closer
+	{
+		int fd;
+		~fd_closer() { if (fd >= 0) close(fd); }
+	};
+
+	bool add_fd(int epoll_fd, int fd)
+	{
+		epoll_event ev;
+		memset(&ev, 0x00, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+	}
+
+	// Runs whole server on the calling thread, returns false if it couldn't
+	// be set up. Everything runs sequentially, so game state isn't locked.
+	bool run()
+	{
+		const int flags = fcntl(server_socket, F_GETFL, 0);
+		if (flags < 0 || fcntl(server_socket, F_SETFL, flags | O_NONBLOCK) < 0)
+			return false;
+
+		start_rounds();
+		const int tick_fd = create_timer(at(round_scheduler.next_deadline()), TFD_TIMER_ABSTIME);
+		const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		const fd_closer tick_closer{ tick_fd }, epoll_closer{ epoll_fd };
+		if (tick_fd < 0 || epoll_fd < 0
+			|| !add_fd(epoll_fd, server_socket)
+			|| !add_fd(epoll_fd, tick_fd))
+		{
+			fcntl(server_socket, F_SETFL, flags);
+			return false;
+		}
+
+		datagram_receiver receiver(server_socket);
+		datagram_batch batch(server_socket);
+
+		constexpr int MAX_EVENTS = 2;
+		// Socket is level-triggered, so datagrams left after that many
+		// batches wait for the next wakeup and can't hold rounds back
+		constexpr int MAX_RECEIVE_BATCHES = 16;
+		epoll_event events[MAX_EVENTS];
+		while (true)
+		{
+			const int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+			if (count < 0)
 			{
-				// Override clients' old next_expected_events if needed (e.g. for NEW_GAME)
-				const auto next_expected_event = game_state.send_new_events ? 0 :
-					kv.second.last_message.next_expected_event;
+				if (errno == EINTR)
+					continue;
+				perror("epoll_wait");
+				std::exit(1);
+			}
 
-				clients[kv.first] = next_expected_event;
+			for (int i = 0; i < count; ++i)
+			{
+				const int fd = events[i].data.fd;
+				if (fd == server_socket)
+				{
+					size_t reply_budget = SEND_PASS_BYTE_BUDGET;
+					int received = 0;
+					for (int batches = 0; batches < MAX_RECEIVE_BATCHES
+						&& (received = receiver.receive()) > 0; ++batches)
+					{
+						for (int j = 0; j < received; ++j)
+						{
+							handle_client_datagram(receiver.data(j), receiver.length(j),
+								receiver.truncated(j), receiver.address(j), batch, reply_budget);
+						}
+					}
+					if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+						fprintf(stderr, "error on datagram from client socket\n");
+				}
+				else if (fd == tick_fd)
+				{
+					read_timer(tick_fd);
+					run_due_rounds();
+
+					const auto next = at(round_scheduler.next_deadline());
+					timerfd_settime(tick_fd, TFD_TIMER_ABSTIME, &next, nullptr);
+				}
 			}
 
-			if (game_state.send_new_events)
-				game_state.send_new_events = false;
+			// Send replies and events generated by rounds (or NEW_GAME) at once
+			if (game_state.events_pending)
+				queue_events(batch);
+			batch.flush();
 		}
+	}
+} // epoll_loop
+#endif
+
+#ifdef HAVE_IO_URING
+namespace uring {
+	// Kinds of operations, stored in the lowest bits of user_data
+	enum op_kind : std::uint64_t {
+		RECV = 0,
+		TICK = 1,
+		SEND = 2,
+	};
+	constexpr int OP_KIND_BITS = 2;
+	constexpr std::uint64_t OP_KIND_MASK = (1 << OP_KIND_BITS) - 1;
+	constexpr std::uint16_t RECV_BUFFER_GROUP = 0;
+	constexpr unsigned RECV_BUFFER_COUNT = 256;
+
+	// Datagrams of a single send pass, kept alive until all their sends complete
+	struct send_pass {
+		std::unique_ptr<datagram_batch> batch;
+		const std::vector<mmsghdr>* messages = nullptr; // built from batch
+		size_t posted = 0; // messages posted so far, in order
+		size_t pending = 0;
+	};
+
+	struct loop_state {
+		io_ring ring;
+		msghdr recv_msg;
+		__kernel_timespec tick_timeout;
+
+		std::map<std::uint64_t, send_pass> send_passes;
+		std::uint64_t next_pass_id = 0;
+		// Passes whose messages didn't all fit in the submission queue, the
+		// rest is posted before anything else
+		std::deque<std::uint64_t> unposted_passes;
+
+		// Replies to heartbeats and new events, queued while handling the
+		// current batch of completions
+		std::unique_ptr<datagram_batch> outgoing;
+	};
+
+	template<typename Duration>
+	__kernel_timespec to_timespec(Duration duration)
+	{
+		const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+		__kernel_timespec ts;
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		return ts;
+	}
 
-		int sent_events = 0;
-		for (auto& kv : clients) {
-			sent_events += broadcast_events(events, game_id, kv.first, kv.second);
+	bool post_recv(loop_state& state)
+	{
+		io_uring_sqe* sqe = state.ring.get_sqe();
+		if (sqe == nullptr)
+			return false;
+
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = server_socket;
+		sqe->addr = reinterpret_cast<std::uint64_t>(&state.recv_msg);
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = RECV_BUFFER_GROUP;
+		sqe->user_data = RECV;
+		return true;
+	}
+
+	// Multishot RECVMSG needs Linux 6.0, older kernels fail it as soon as it's
+	// submitted. Completion of a datagram which arrived already is left for
+	// the loop.
+	bool recv_supported(loop_state& state)
+	{
+		if (state.ring.submit_and_wait(0) < 0)
+			return false;
+
+		const io_uring_cqe* cqe = state.ring.peek_cqe();
+		if (cqe == nullptr || (cqe->user_data & OP_KIND_MASK) != RECV
+			|| cqe->res >= 0 || cqe->res == -ENOBUFS)
+			return true;
+
+		fprintf(stderr, "io_uring multishot receive failed: %s\n", strerror(-cqe->res));
+		state.ring.cqe_seen();
+		return false;
+	}
+
+	// Ring can't take more entries only if io_uring_enter fails, there's no
+	// way to go on then
+	void ensure_posted(bool posted, const char* what)
+	{
+		if (!posted)
+		{
+			perror(what);
+			std::exit(1);
 		}
+	}
 
-		std::this_thread::sleep_for(SEND_INTERVAL);
+	bool post_timeout(io_uring_sqe* sqe, __kernel_timespec* timeout, op_kind kind,
+		std::uint32_t flags = 0)
+	{
+		if (sqe == nullptr)
+			return false;
+
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = reinterpret_cast<std::uint64_t>(timeout);
+		sqe->len = 1;
+		sqe->timeout_flags = flags;
+		sqe->user_data = kind;
+		return true;
+	}
+
+	// Absolute timeouts use CLOCK_MONOTONIC, same as steady_clock
+	bool post_tick(loop_state& state)
+	{
+		state.tick_timeout = to_timespec(round_scheduler.next_deadline().time_since_epoch());
+		return post_timeout(state.ring.get_sqe(), &state.tick_timeout, TICK, IORING_TIMEOUT_ABS);
+	}
+
+	// Posts pass's messages which weren't posted yet, returns false if the
+	// submission queue filled up before all of them were
+	bool post_messages(loop_state& state, std::uint64_t pass_id, send_pass& pass)
+	{
+		const auto& messages = *pass.messages;
+		for (; pass.posted < messages.size(); ++pass.posted)
+		{
+			io_uring_sqe* sqe = state.ring.get_sqe();
+			if (sqe == nullptr)
+				return false;
+
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = server_socket;
+			sqe->addr = reinterpret_cast<std::uint64_t>(&messages[pass.posted].msg_hdr);
+			sqe->len = 1;
+			sqe->user_data = (((pass_id << 16) | pass.posted) << OP_KIND_BITS) | SEND;
+			pass.pending++;
+		}
+		return true;
 	}
-}
+
+	// Returns false if some passes are still waiting for the submission queue
+	bool post_unposted(loop_state& state)
+	{
+		while (!state.unposted_passes.empty())
+		{
+			const std::uint64_t pass_id = state.unposted_passes.front();
+			if (!post_messages(state, pass_id, state.send_passes[pass_id]))
+				return false;
+			state.unposted_passes.pop_front();
+		}
+		return true;
+	}
+
+	void post_batch(loop_state& state, std::unique_ptr<datagram_batch> batch)
+	{
+		if (batch->size() == 0)
+			return;
+
+		const std::uint64_t pass_id = state.next_pass_id++;
+		send_pass& pass = state.send_passes[pass_id];
+		pass.messages = &batch->build_messages();
+		pass.batch = std::move(batch);
+
+		// Datagrams which don't fit now are posted once completions free up
+		// the queue, after the earlier ones so they stay in order
+		if (!post_unposted(state) || !post_messages(state, pass_id, pass))
+			state.unposted_passes.push_back(pass_id);
+	}
+
+	void post_outgoing(loop_state& state)
+	{
+		post_unposted(state);
+		if (game_state.events_pending)
+			queue_events(*state.outgoing);
+		if (state.outgoing->size() == 0)
+			return;
+
+		post_batch(state, std::move(state.outgoing));
+		state.outgoing = std::make_unique<datagram_batch>(server_socket);
+	}
+
+	void handle_recv(loop_state& state, const io_uring_cqe& cqe, size_t& reply_budget)
+	{
+		if (cqe.res < 0)
+		{
+			if (cqe.res != -ENOBUFS)
+				fprintf(stderr, "error on datagram from client socket: %s\n", strerror(-cqe.res));
+			return;
+		}
+		if (!(cqe.flags & IORING_CQE_F_BUFFER))
+			return;
+
+		const std::uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		const std::uint8_t* buffer = state.ring.buffer(buffer_id);
+
+		// Buffer contains io_uring_recvmsg_out header, reserved space for the
+		// address and then the payload
+		io_uring_recvmsg_out out;
+		memcpy(&out, buffer, sizeof(out));
+
+		sockaddr_storage client_address;
+		memset(&client_address, 0x00, sizeof(client_address));
+		memcpy(&client_address, buffer + sizeof(out),
+			std::min<size_t>(out.namelen, state.recv_msg.msg_namelen));
+
+		const char* payload = reinterpret_cast<const char*>(buffer + sizeof(out)
+			+ state.recv_msg.msg_namelen + state.recv_msg.msg_controllen);
+		handle_client_datagram(payload, out.payloadlen, (out.flags & MSG_TRUNC) != 0,
+			client_address, *state.outgoing, reply_budget);
+
+		state.ring.recycle_buffer(buffer_id);
+	}
+
+	void handle_send(loop_state& state, const io_uring_cqe& cqe)
+	{
+		const std::uint64_t id = cqe.user_data >> OP_KIND_BITS;
+		const auto it = state.send_passes.find(id >> 16);
+		if (it == state.send_passes.end())
+			return;
+
+		send_pass& pass = it->second;
+		if (cqe.res < 0)
+			pass.batch->handle_send_error(id & 0xFFFF, -cqe.res, *state.outgoing);
+
+		// Pass stays around until its remaining messages are posted and sent
+		if (--pass.pending == 0 && pass.posted == pass.messages->size())
+			state.send_passes.erase(it);
+	}
+
+	// Returns false if io_uring can't be used and we should fall back
+	bool run()
+	{
+		loop_state state;
+		if (!state.ring.init(1024))
+			return false;
+		if (!state.ring.setup_buffer_ring(RECV_BUFFER_GROUP, RECV_BUFFER_COUNT,
+				sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage)
+				+ datagram_receiver::MAX_DATAGRAM_SIZE))
+			return false;
+
+		memset(&state.recv_msg, 0x00, sizeof(state.recv_msg));
+		state.recv_msg.msg_namelen = sizeof(sockaddr_storage);
+		state.outgoing = std::make_unique<datagram_batch>(server_socket);
+
+		if (!post_recv(state) || !recv_supported(state))
+			return false;
+
+		start_rounds();
+		if (!post_tick(state))
+			return false;
+
+		while (true)
+		{
+			if (state.ring.submit_and_wait(1) < 0)
+			{
+				perror("io_uring_enter");
+				std::exit(1);
+			}
+
+			// Replies to datagrams received since the last submission
+			size_t reply_budget = SEND_PASS_BYTE_BUDGET;
+			while (io_uring_cqe* cqe = state.ring.peek_cqe())
+			{
+				const io_uring_cqe completion = *cqe;
+				state.ring.cqe_seen();
+
+				switch (completion.user_data & OP_KIND_MASK)
+				{
+				case RECV:
+				{
+					handle_recv(state, completion, reply_budget);
+					// Multishot receive got terminated, re-arm it unless it
+					// failed for other reason than running out of buffers
+					if (!(completion.flags & IORING_CQE_F_MORE))
+					{
+						if (completion.res < 0 && completion.res != -ENOBUFS)
+						{
+							fprintf(stderr, "io_uring receive failed: %s\n", strerror(-completion.res));
+							std::exit(1);
+						}
+						ensure_posted(post_recv(state), "io_uring receive");
+					}
+					break;
+				}
+				case TICK:
+				{
+					run_due_rounds();
+					ensure_posted(post_tick(state), "io_uring round timeout");
+					break;
+				}
+				case SEND:
+				{
+					handle_send(state, completion);
+					break;
+				}
+				}
+			}
+			// Replies and new events are submitted with the next io_uring_enter
+			post_outgoing(state);
+		}
+	}
+} // uring
+#endif
 
 namespace {
 	void ensure_with_errno(int value, const char* msg)
@@ -742,6 +1371,19 @@ int main(int argc, char* argv[])
 			configuration.seed_provided = true;
 			break;
 		}
+		case 'm':
+		{
+			const char* mode = argv[i + 1];
+			if (strcmp(mode, "threads") == 0)
+				configuration.mode = server_mode::threads;
+			else if (strcmp(mode, "epoll") == 0)
+				configuration.mode = server_mode::epoll;
+			else if (strcmp(mode, "io_uring") == 0)
+				configuration.mode = server_mode::io_uring;
+			else
+				util::fatal("Invalid server mode %s", mode);
+			break;
+		}
 		default:
 		{
 			printf("Bad argument: %s\n%s", arg, usage_msg);
@@ -782,13 +1424,26 @@ int main(int argc, char* argv[])
 	fprintf(stderr, "errno: %d\n", errno);
 	ensure_with_errno(ret, "bind");
 
-	std::thread recv(receive_messages_job);
-	std::thread send(send_events_job);
-	std::thread update(update_game_job);
+	if (configuration.mode == server_mode::epoll)
+	{
+#ifdef __linux__
+		if (!epoll_loop::run())
+			perror("epoll mode failed, falling back to threads");
+#else
+		fprintf(stderr, "epoll mode is only available on Linux, falling back to threads\n");
+#endif
+	}
+	else if (configuration.mode == server_mode::io_uring)
+	{
+#ifdef HAVE_IO_URING
+		if (!uring::run())
+			fprintf(stderr, "io_uring is not available, falling back to threads\n");
+#else
+		fprintf(stderr, "Server was built without io_uring support, falling back to threads\n");
+#endif
+	}
 
-	recv.join();
-	send.join();
-	update.join();
+	run_threads();
 
 	return 0;
 }
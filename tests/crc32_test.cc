@@ -0,0 +1,127 @@
+// Cross-checks xcrc32 and every implementation the CPU supports against the
+// CRC computed bit by bit from the polynomial. Run with --bench to also
+// measure their throughput.
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "../crc32.h"
+#include "test_util.h"
+
+namespace
+{
+	constexpr std::uint32_t CRC32_POLY = 0x04c11db7;
+
+	std::uint32_t crc32_bitwise(const unsigned char* buf, size_t len, std::uint32_t crc)
+	{
+		for (size_t i = 0; i < len; ++i)
+		{
+			crc ^= static_cast<std::uint32_t>(buf[i]) << 24;
+			for (int bit = 0; bit < 8; ++bit)
+				crc = (crc & 0x80000000) ? (crc << 1) ^ CRC32_POLY : (crc << 1);
+		}
+		return crc;
+	}
+
+	using crc32_fn = std::uint32_t (*)(const unsigned char*, size_t, std::uint32_t);
+
+	struct implementation
+	{
+		const char* name;
+		crc32_fn crc;
+	};
+
+	std::uint32_t crc32_dispatched(const unsigned char* buf, size_t len, std::uint32_t crc)
+	{
+		return xcrc32(buf, static_cast<int>(len), crc);
+	}
+
+	std::vector<implementation> supported_implementations()
+	{
+		std::vector<implementation> result = {
+			{ "xcrc32", crc32_dispatched },
+			{ "bytewise", crc32_bytewise },
+			{ "slicing8", crc32_slicing8 },
+		};
+		if (crc32_pclmul_supported())
+			result.push_back({ "pclmul", crc32_pclmul });
+		if (crc32_arm_supported())
+			result.push_back({ "arm", crc32_arm });
+		return result;
+	}
+
+	// Called during static initialization, before anything in crc32.cc could
+	// have been initialized dynamically
+	const std::uint32_t static_init_crc = [] {
+		const unsigned char data[100] = { 1, 2, 3 };
+		return xcrc32(data, sizeof(data), 0xffffffff);
+	}();
+
+	void benchmark()
+	{
+		std::vector<unsigned char> data(64 * 1024);
+		for (size_t i = 0; i < data.size(); ++i)
+			data[i] = static_cast<unsigned char>(i * 131);
+
+		constexpr int ROUNDS = 2000;
+		for (const auto& impl : supported_implementations())
+		{
+			std::uint32_t sum = 0;
+			const auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < ROUNDS; ++i)
+				sum += impl.crc(data.data(), data.size(), 0xffffffff);
+			const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			printf("%-10s %8.1f MB/s (%08x)\n", impl.name,
+				ROUNDS * data.size() / elapsed.count() / 1e6, sum);
+		}
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	std::mt19937 rng(12345);
+	std::vector<unsigned char> data(2048 + 16);
+	for (auto& byte : data)
+		byte = static_cast<unsigned char>(rng());
+
+	{
+		const unsigned char check[] = "123456789";
+		// CRC-32/MPEG-2 check value (same polynomial, init and no reflection)
+		CHECK(xcrc32(check, 9, 0xffffffff) == 0x0376e6e7);
+	}
+
+	{
+		const unsigned char static_data[100] = { 1, 2, 3 };
+		CHECK(static_init_crc == crc32_bitwise(static_data, sizeof(static_data), 0xffffffff));
+	}
+
+	// Every length around the SIMD block sizes, at different alignments
+	for (const auto& impl : supported_implementations())
+	{
+		printf("crc32_test: checking %s\n", impl.name);
+		for (size_t len = 0; len <= 2048; len += (len < 300 ? 1 : 61))
+		{
+			for (size_t offset = 0; offset < 16; offset += 5)
+			{
+				const std::uint32_t init = static_cast<std::uint32_t>(rng());
+				const unsigned char* buf = data.data() + offset;
+				CHECK(impl.crc(buf, len, init) == crc32_bitwise(buf, len, init));
+			}
+		}
+	}
+
+	// CRC of data split across calls is the same as of the whole
+	for (size_t split = 0; split <= 300; split += 7)
+	{
+		const std::uint32_t first = xcrc32(data.data(), static_cast<int>(split), 0xffffffff);
+		CHECK(xcrc32(data.data() + split, static_cast<int>(300 - split), first)
+			== xcrc32(data.data(), 300, 0xffffffff));
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+		benchmark();
+
+	return test_result("crc32_test");
+}
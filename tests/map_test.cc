@@ -0,0 +1,150 @@
+// Checks map occupancy on dense and sparse boards. Run with --bench to also
+// measure lookups and inserts of a synthetic game against the std::set of
+// pixels map used to keep.
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "../map.h"
+#include "test_util.h"
+
+namespace
+{
+	void check_board(map& board)
+	{
+		const map::position_t corners[] = {
+			{ 0, 0 }, { board.width - 1, 0 }, { 0, board.height - 1 },
+			{ board.width - 1, board.height - 1 }, { board.width / 2, board.height / 3 },
+		};
+		for (const auto& pos : corners)
+		{
+			CHECK(!board.is_occupied(pos));
+			CHECK(!board.set_occupied(pos));
+			CHECK(board.is_occupied(pos));
+			CHECK(board.set_occupied(pos));
+		}
+		CHECK(!board.is_occupied(map::position_t(1, 0)));
+
+		// Pixels outside the board are always free
+		CHECK(!board.is_inside(map::position_t(board.width, 0)));
+		CHECK(!board.set_occupied(map::position_t(board.width, 0)));
+		CHECK(!board.is_occupied(map::position_t(board.width, 0)));
+		CHECK(!board.is_occupied(map::position_t(0, board.height)));
+
+		board.clear();
+		for (const auto& pos : corners)
+			CHECK(!board.is_occupied(pos));
+	}
+
+	// Position updates of players turning at random, like in a long game;
+	// players leaving the board start over somewhere else
+	std::vector<map::position_t> synthetic_game(std::uint32_t width, std::uint32_t height,
+		int players, size_t updates)
+	{
+		std::mt19937 rng(2017);
+		std::vector<double> x(players), y(players), direction(players);
+		const auto respawn = [&](int i) {
+			x[i] = rng() % width + 0.5;
+			y[i] = rng() % height + 0.5;
+			direction[i] = rng() % 360;
+		};
+		for (int i = 0; i < players; ++i)
+			respawn(i);
+
+		std::vector<map::position_t> positions;
+		positions.reserve(updates);
+		while (positions.size() < updates)
+		{
+			for (int i = 0; i < players && positions.size() < updates; ++i)
+			{
+				direction[i] += static_cast<int>(rng() % 3) * 6 - 6;
+				x[i] += std::cos(direction[i] * M_PI / 180);
+				y[i] += std::sin(direction[i] * M_PI / 180);
+				if (x[i] < 0 || y[i] < 0 || x[i] >= width || y[i] >= height)
+					respawn(i);
+				positions.push_back(map::make_pos(x[i], y[i]));
+			}
+		}
+		return positions;
+	}
+
+	void benchmark()
+	{
+		constexpr std::uint32_t WIDTH = 800;
+		constexpr std::uint32_t HEIGHT = 600;
+		const auto positions = synthetic_game(WIDTH, HEIGHT, 8, 480000);
+
+		const auto measure = [&](const char* name, auto&& occupy)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			size_t hits = 0;
+			for (const auto& pos : positions)
+				hits += occupy(pos);
+			const std::chrono::duration<double, std::milli> elapsed
+				= std::chrono::steady_clock::now() - start;
+			printf("%-8s %8.1f ms (%zu hits)\n", name, elapsed.count(), hits);
+		};
+
+		std::set<map::position_t> pixels;
+		measure("std::set", [&](const map::position_t& pos) {
+			if (pos.first >= WIDTH || pos.second >= HEIGHT || pixels.count(pos) > 0)
+				return true;
+			pixels.insert(pos);
+			return false;
+		});
+
+		map board(WIDTH, HEIGHT);
+		measure("map", [&](const map::position_t& pos) {
+			if (!board.is_inside(pos) || board.is_occupied(pos))
+				return true;
+			board.set_occupied(pos);
+			return false;
+		});
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	{
+		map board;
+		CHECK(!board.sparse);
+		check_board(board);
+	}
+	{
+		map board(1, 1);
+		CHECK(!board.set_occupied(map::position_t(0, 0)));
+		CHECK(board.is_occupied(0.5, 0.5));
+	}
+	{
+		// Row length not a multiple of the 64-bit word
+		map board(100, 37);
+		check_board(board);
+	}
+	{
+		map board(1 << 20, 1 << 20);
+		CHECK(board.sparse);
+		check_board(board);
+		CHECK(board.tiles.empty());
+	}
+
+	// Both representations agree on a synthetic game
+	{
+		const auto positions = synthetic_game(300, 200, 4, 50000);
+		map dense(300, 200);
+		map sparse(300, 200);
+		sparse.sparse = true;
+		sparse.pixels.clear();
+		for (const auto& pos : positions)
+			CHECK(dense.set_occupied(pos) == sparse.set_occupied(pos));
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+		benchmark();
+
+	return test_result("map_test");
+}
@@ -0,0 +1,170 @@
+// Checks serialization of protocol messages against the parser and against
+// each other where there are several implementations.
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "../protocol.h"
+#include "test_util.h"
+
+namespace
+{
+	std::vector<event> random_pixels(std::mt19937& rng, size_t count)
+	{
+		std::vector<event> events;
+		for (size_t i = 0; i < count; ++i)
+		{
+			// Mostly small coordinates like in a game, sometimes any value
+			const bool any = rng() % 4 == 0;
+			event ev(pixel { static_cast<std::uint8_t>(rng()),
+				any ? static_cast<std::uint32_t>(rng()) : static_cast<std::uint32_t>(rng() % 2000),
+				any ? static_cast<std::uint32_t>(rng()) : static_cast<std::uint32_t>(rng() % 2000) });
+			ev.event_no = any ? static_cast<std::uint32_t>(rng()) : static_cast<std::uint32_t>(i);
+			events.push_back(ev);
+		}
+		return events;
+	}
+
+	std::vector<std::uint8_t> serialize_one_by_one(const std::vector<event>& events)
+	{
+		std::vector<std::uint8_t> bytes(events.size() * PIXEL_EVENT_LEN);
+		for (size_t i = 0; i < events.size(); ++i)
+			CHECK(events[i].serialize(bytes.data() + i * PIXEL_EVENT_LEN, PIXEL_EVENT_LEN) == PIXEL_EVENT_LEN);
+		return bytes;
+	}
+
+	void test_serialize_pixel_events()
+	{
+		std::mt19937 rng(2017);
+		// Counts below, at and around multiples of the SIMD batch of 8 events
+		for (size_t count = 0; count <= 70; ++count)
+		{
+			const std::vector<event> events = random_pixels(rng, count);
+			const std::vector<std::uint8_t> expected = serialize_one_by_one(events);
+
+			// One extra byte to catch writes past the end
+			std::vector<std::uint8_t> batched(expected.size() + 1, 0xaa);
+			serialize_pixel_events(events.data(), count, batched.data());
+			CHECK(memcmp(batched.data(), expected.data(), expected.size()) == 0);
+			CHECK(batched.back() == 0xaa);
+
+			std::vector<std::uint8_t> generic(expected.size() + 1, 0xaa);
+			serialize_pixel_events_generic(events.data(), count, generic.data());
+			CHECK(memcmp(generic.data(), expected.data(), expected.size()) == 0);
+			CHECK(generic.back() == 0xaa);
+		}
+	}
+
+	void test_parse_pixel_events()
+	{
+		std::mt19937 rng(42);
+		const size_t per_datagram = server_message::MAX_EVENTS_LEN / PIXEL_EVENT_LEN;
+		const std::vector<event> events = random_pixels(rng, per_datagram);
+
+		std::vector<std::uint8_t> datagram(server_message::HEADER_LEN + events.size() * PIXEL_EVENT_LEN);
+		const std::uint32_t game_id = htonl(123456);
+		memcpy(datagram.data(), &game_id, sizeof(game_id));
+		serialize_pixel_events(events.data(), events.size(), datagram.data() + server_message::HEADER_LEN);
+
+		const auto parsed = server_message::from(reinterpret_cast<const char*>(datagram.data()),
+			datagram.size());
+		CHECK(parsed.second);
+		CHECK(parsed.first.game_id == 123456);
+		CHECK(parsed.first.events.size() == events.size());
+		for (size_t i = 0; i < std::min(events.size(), parsed.first.events.size()); ++i)
+		{
+			const event& ev = parsed.first.events[i];
+			CHECK(ev.event_type == PIXEL);
+			CHECK(ev.event_no == events[i].event_no);
+			CHECK(ev.pixel_data.player_number == events[i].pixel_data.player_number);
+			CHECK(ev.pixel_data.x == events[i].pixel_data.x);
+			CHECK(ev.pixel_data.y == events[i].pixel_data.y);
+		}
+
+		// Corrupted CRC makes the event (and the rest of the datagram) invalid
+		datagram[server_message::HEADER_LEN + 3 * PIXEL_EVENT_LEN - 1] ^= 1;
+		const auto corrupted = server_message::from(reinterpret_cast<const char*>(datagram.data()),
+			datagram.size());
+		CHECK(corrupted.first.events.size() == 2);
+	}
+
+	// Parser used to compare the whole datagram length with the limit for
+	// every event, so it dropped all events of datagrams over 490 bytes
+	void test_parse_full_datagram()
+	{
+		std::vector<std::string> names;
+		for (char c = 'a'; c < 'a' + 10; ++c)
+			names.push_back(std::string(20, c));
+
+		server_message msg;
+		msg.game_id = 7;
+		msg.player_names = names;
+		msg.events.push_back(event(new_game { 800, 600 }));
+		while (true)
+		{
+			event ev(pixel { 1, 2, static_cast<std::uint32_t>(msg.events.size()) });
+			ev.event_no = static_cast<std::uint32_t>(msg.events.size());
+			msg.events.push_back(ev);
+
+			if (msg.as_stream().size() > static_cast<size_t>(MAX_EVENT_PACKET_DATA_SIZE))
+			{
+				msg.events.pop_back();
+				break;
+			}
+		}
+
+		const std::vector<std::uint8_t> stream = msg.as_stream();
+		CHECK(stream.size() > 490);
+
+		const auto parsed = server_message::from(reinterpret_cast<const char*>(stream.data()),
+			stream.size());
+		CHECK(parsed.second);
+		CHECK(parsed.first.events.size() == msg.events.size());
+		CHECK(parsed.first.player_names == names);
+		if (!parsed.first.events.empty())
+			CHECK(parsed.first.events.back().pixel_data.y == msg.events.back().pixel_data.y);
+	}
+
+	// NEW_GAME with player names of MAX_PLAYER_NAMES_LEN fills whole datagram
+	void test_max_player_names_len()
+	{
+		std::vector<std::string> names;
+		size_t names_len = 0;
+		while (names_len + 65 <= static_cast<size_t>(MAX_PLAYER_NAMES_LEN))
+		{
+			names.push_back(std::string(64, static_cast<char>('a' + names.size())));
+			names_len += 65;
+		}
+		names.push_back(std::string(MAX_PLAYER_NAMES_LEN - names_len - 1, 'z'));
+
+		server_message msg;
+		msg.game_id = 1;
+		msg.player_names = names;
+		msg.events.push_back(event(new_game { 800, 600 }));
+
+		const std::vector<std::uint8_t> stream = msg.as_stream();
+		CHECK(stream.size() == static_cast<size_t>(MAX_EVENT_PACKET_DATA_SIZE));
+
+		const auto parsed = server_message::from(reinterpret_cast<const char*>(stream.data()),
+			stream.size());
+		CHECK(parsed.second);
+		CHECK(parsed.first.player_names == names);
+	}
+}
+
+int main()
+{
+	test_serialize_pixel_events();
+	test_parse_pixel_events();
+	test_parse_full_datagram();
+	test_max_player_names_len();
+	return test_result("protocol_test");
+}
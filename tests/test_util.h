@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdio>
+
+// Tests are plain executables, failed checks are reported on stderr and
+// through the exit code
+static int failed_checks = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			failed_checks++; \
+		} \
+	} while (0)
+
+inline int test_result(const char* name)
+{
+	if (failed_checks > 0)
+		fprintf(stderr, "%s: %d checks failed\n", name, failed_checks);
+	return failed_checks > 0 ? 1 : 0;
+}
@@ -0,0 +1,50 @@
+#include "tick_scheduler.h"
+
+#include <algorithm>
+
+tick_scheduler::tick_scheduler(clock::duration budget)
+: m_budget(budget)
+{
+}
+
+void tick_scheduler::start(clock::time_point now)
+{
+	m_deadline = now + m_budget;
+}
+
+tick_scheduler::clock::time_point tick_scheduler::next_deadline() const
+{
+	return m_deadline;
+}
+
+unsigned tick_scheduler::ticks_due(clock::time_point now)
+{
+	if (now < m_deadline)
+		return 0;
+
+	// Budget shorter than a clock tick (or of default constructed scheduler)
+	// would divide by zero
+	const clock::duration budget = std::max(m_budget, clock::duration(1));
+	const std::uint64_t due = 1 + (now - m_deadline) / budget;
+	const unsigned run = static_cast<unsigned>(std::min<std::uint64_t>(due, MAX_CATCH_UP_TICKS));
+
+	if (due > 1)
+		m_counters.overruns++;
+	m_counters.ticks += run;
+	m_counters.caught_up += run - 1;
+	m_counters.skipped += due - run;
+
+	// Deadlines stay on the original grid, skipped rounds are just dropped
+	m_deadline += budget * static_cast<clock::duration::rep>(due);
+	return run;
+}
+
+const tick_scheduler::counters& tick_scheduler::stats() const
+{
+	return m_counters;
+}
+
+void tick_scheduler::reset_stats()
+{
+	m_counters = counters();
+}
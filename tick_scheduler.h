@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+
+// Schedules game rounds at absolute deadlines on the steady clock, so neither
+// wall-clock jumps nor sleep overshoot make the long-run tick rate drift.
+// When the server falls behind it runs several rounds in a row to catch up,
+// but at most MAX_CATCH_UP_TICKS at once; rounds over that limit are skipped.
+class tick_scheduler
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	constexpr static unsigned MAX_CATCH_UP_TICKS = 5;
+
+	struct counters
+	{
+		std::uint64_t ticks = 0; // rounds run
+		std::uint64_t overruns = 0; // times a deadline was missed by a whole round or more
+		std::uint64_t caught_up = 0; // extra rounds run back-to-back to catch up
+		std::uint64_t skipped = 0; // rounds dropped because of the catch-up limit
+	};
+
+	tick_scheduler() = default;
+	explicit tick_scheduler(clock::duration budget);
+
+	// First round is due a budget after now
+	void start(clock::time_point now);
+	clock::time_point next_deadline() const;
+	// Returns how many rounds should be run now (0 if next deadline wasn't
+	// reached yet) and moves the deadline past them
+	unsigned ticks_due(clock::time_point now);
+
+	const counters& stats() const;
+	void reset_stats();
+
+private:
+	clock::duration m_budget { 0 };
+	clock::time_point m_deadline;
+	counters m_counters;
+};